@@ -0,0 +1,438 @@
+// Allocator benchmarks
+// Every workload calls plain malloc/free, so the same binary measures glibc
+// when run directly and memalloc when run with LD_PRELOAD (see run.sh).
+// Each workload runs in a child process, so peak RSS is its own.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+typedef std::chrono::steady_clock bench_clock;
+
+static inline uint64_t now_ns(void){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now().time_since_epoch()).count();
+}
+
+// Small, fast random numbers so the generator doesn't dominate the loops
+struct rng {
+    uint64_t state;
+    explicit rng(uint64_t seed) : state(seed * 0x9E3779B97F4A7C15ULL + 1){}
+    uint64_t next(void){
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1DULL;
+    }
+    // Uniform in [low, high]
+    size_t range(size_t low, size_t high){
+        return low + next() % (high - low + 1);
+    }
+};
+
+// Only every LATENCY_EVERY'th operation is timed, reading the clock around
+// every call would cost more than most of the calls themselves
+#define LATENCY_EVERY 16
+
+// Latency samples of one thread, preallocated so recording never allocates
+struct latencies {
+    std::vector<uint32_t> samples;
+    unsigned counter = 0;
+    latencies(){
+        samples.reserve(1 << 20);
+    }
+    bool due(void){
+        return ++counter % LATENCY_EVERY == 0 && samples.size() < samples.capacity();
+    }
+    void add(uint64_t ns){
+        samples.push_back(ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns);
+    }
+};
+
+static double percentile(std::vector<uint32_t> &samples, double p){
+    if (samples.empty()){
+        return 0;
+    }
+    size_t index = (size_t)(p * (samples.size() - 1));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+static long peak_rss_kb(void){
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static long current_rss_kb(void){
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f){
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2){
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// One result line: name, throughput, latency percentiles of timed operations and peak RSS
+static void report(const char *name, uint64_t ops, uint64_t elapsed_ns, std::vector<uint32_t> &samples){
+    double seconds = elapsed_ns / 1e9;
+    double p50 = percentile(samples, 0.50);
+    double p99 = percentile(samples, 0.99);
+    double p999 = percentile(samples, 0.999);
+    printf("%-28s %14.0f ops/s  p50 %6.0f ns  p99 %7.0f ns  p999 %8.0f ns  peak rss %8ld KB\n",
+           name, ops / seconds, p50, p99, p999, peak_rss_kb());
+    fflush(stdout);
+}
+
+// Single thread: malloc and free one size in a tight loop, then in batches
+static void bench_sizes(void){
+    static const size_t sizes[] = { 16, 32, 64, 128, 256, 512, 1024, 4096, 16384, 65536, 262144 };
+    for (size_t size : sizes){
+        latencies lat;
+        unsigned iterations = size > 16384 ? 200000 : 2000000;
+        uint64_t start = now_ns();
+        for (unsigned i = 0; i < iterations; i++){
+            if (lat.due()){
+                uint64_t t = now_ns();
+                char *p = (char*)malloc(size);
+                p[0] = 1;
+                free(p);
+                lat.add(now_ns() - t);
+            } else {
+                char *p = (char*)malloc(size);
+                p[0] = 1;
+                free(p);
+            }
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "sizes/loop/%zu", size);
+        report(name, iterations, now_ns() - start, lat.samples);
+
+        // Many live blocks of the size at once
+        latencies batch_lat;
+        std::vector<void*> blocks(1000);
+        unsigned rounds = iterations / 1000;
+        start = now_ns();
+        for (unsigned r = 0; r < rounds; r++){
+            for (void *&p : blocks){
+                if (batch_lat.due()){
+                    uint64_t t = now_ns();
+                    p = malloc(size);
+                    batch_lat.add(now_ns() - t);
+                } else {
+                    p = malloc(size);
+                }
+                static_cast<char*>(p)[0] = 1;
+            }
+            for (void *p : blocks){
+                free(p);
+            }
+        }
+        snprintf(name, sizeof(name), "sizes/batch/%zu", size);
+        report(name, (uint64_t)rounds * 1000 * 2, now_ns() - start, batch_lat.samples);
+    }
+}
+
+// A single producer single consumer ring used to hand blocks to another thread
+struct handoff {
+    static const unsigned SLOTS = 4096;
+    std::atomic<void*> slots[SLOTS];
+    std::atomic<unsigned> head;
+    std::atomic<unsigned> tail;
+    handoff() : head(0), tail(0){
+        for (auto &slot : slots){
+            slot.store(nullptr);
+        }
+    }
+    bool push(void *p){
+        unsigned h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == SLOTS){
+            return false;
+        }
+        slots[h % SLOTS].store(p, std::memory_order_relaxed);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+    void *pop(void){
+        unsigned t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)){
+            return nullptr;
+        }
+        void *p = slots[t % SLOTS].load(std::memory_order_relaxed);
+        tail.store(t + 1, std::memory_order_release);
+        return p;
+    }
+};
+
+// threads threads allocate random small sizes, freeing them locally, or when
+// cross is set handing half of them to the next thread to free
+static void run_threads(unsigned threads, bool cross){
+    const unsigned iterations = 500000;
+    std::vector<latencies> lat(threads);
+    std::vector<handoff> rings(threads);
+    std::atomic<unsigned> done(0);
+    std::vector<std::thread> workers;
+    uint64_t start = now_ns();
+    for (unsigned t = 0; t < threads; t++){
+        workers.emplace_back([&, t]{
+            rng random(t + 1);
+            handoff &in = rings[t];
+            handoff &out = rings[(t + 1) % threads];
+            for (unsigned i = 0; i < iterations; i++){
+                size_t size = random.range(16, 512);
+                void *p;
+                if (lat[t].due()){
+                    uint64_t start_op = now_ns();
+                    p = malloc(size);
+                    lat[t].add(now_ns() - start_op);
+                } else {
+                    p = malloc(size);
+                }
+                static_cast<char*>(p)[0] = 1;
+                if (cross && (i & 1) && out.push(p)){
+                    p = nullptr;
+                }
+                free(p);
+                // Free whatever the previous thread sent over
+                while (void *q = in.pop()){
+                    free(q);
+                }
+            }
+            done.fetch_add(1);
+            // Keep draining until every thread has stopped sending
+            while (done.load() < threads){
+                while (void *q = in.pop()){
+                    free(q);
+                }
+                std::this_thread::yield();
+            }
+            while (void *q = in.pop()){
+                free(q);
+            }
+        });
+    }
+    for (auto &w : workers){
+        w.join();
+    }
+    uint64_t elapsed = now_ns() - start;
+    std::vector<uint32_t> all;
+    for (auto &l : lat){
+        all.insert(all.end(), l.samples.begin(), l.samples.end());
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "threads/%s/%u", cross ? "cross" : "local", threads);
+    report(name, (uint64_t)iterations * threads * 2, elapsed, all);
+}
+
+// Scalability from one thread up to the number of CPUs
+static void bench_threads(void){
+    unsigned max_threads = std::thread::hardware_concurrency();
+    if (max_threads < 2){
+        max_threads = 2;
+    }
+    for (int cross = 0; cross < 2; cross++){
+        for (unsigned threads = 1; threads <= max_threads; threads *= 2){
+            run_threads(threads, cross);
+            if (threads < max_threads && threads * 2 > max_threads){
+                run_threads(max_threads, cross);
+            }
+        }
+    }
+}
+
+// Buffers growing to 1MB, by a constant step and geometrically
+static void bench_realloc(void){
+    for (int geometric = 0; geometric < 2; geometric++){
+        latencies lat;
+        uint64_t ops = 0;
+        uint64_t start = now_ns();
+        for (unsigned round = 0; round < (geometric ? 2000 : 20); round++){
+            char *p = nullptr;
+            size_t size = 16;
+            while (size <= 1024 * 1024){
+                if (lat.due()){
+                    uint64_t t = now_ns();
+                    p = (char*)realloc(p, size);
+                    lat.add(now_ns() - t);
+                } else {
+                    p = (char*)realloc(p, size);
+                }
+                p[size - 1] = 1;
+                ops++;
+                size = geometric ? size + size / 2 : size + 64;
+            }
+            free(p);
+        }
+        report(geometric ? "realloc/geometric" : "realloc/step64", ops, now_ns() - start, lat.samples);
+    }
+}
+
+// Larson: each thread keeps an array of blocks and keeps replacing random
+// ones with blocks of random size. Every round hands the arrays to new threads,
+// so blocks are freed by threads other than the ones that allocated them.
+static void bench_larson(void){
+    unsigned threads = std::thread::hardware_concurrency();
+    if (threads < 2){
+        threads = 2;
+    }
+    const unsigned slots = 1000;
+    const unsigned rounds = 10;
+    const unsigned per_round = 100000;
+    std::vector<std::vector<void*>> arrays(threads, std::vector<void*>(slots, nullptr));
+    std::vector<latencies> lat(threads);
+    uint64_t start = now_ns();
+    for (unsigned round = 0; round < rounds; round++){
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < threads; t++){
+            workers.emplace_back([&, t, round]{
+                rng random(round * threads + t + 1);
+                std::vector<void*> &array = arrays[t];
+                for (unsigned i = 0; i < per_round; i++){
+                    unsigned slot = random.next() % slots;
+                    size_t size = random.range(16, 4096);
+                    free(array[slot]);
+                    if (lat[t].due()){
+                        uint64_t start_op = now_ns();
+                        array[slot] = malloc(size);
+                        lat[t].add(now_ns() - start_op);
+                    } else {
+                        array[slot] = malloc(size);
+                    }
+                    static_cast<char*>(array[slot])[0] = 1;
+                }
+            });
+        }
+        for (auto &w : workers){
+            w.join();
+        }
+        // Pass every array on to the next thread of the next round
+        std::rotate(arrays.begin(), arrays.begin() + 1, arrays.end());
+    }
+    uint64_t elapsed = now_ns() - start;
+    for (auto &array : arrays){
+        for (void *p : array){
+            free(p);
+        }
+    }
+    std::vector<uint32_t> all;
+    for (auto &l : lat){
+        all.insert(all.end(), l.samples.begin(), l.samples.end());
+    }
+    report("larson", (uint64_t)threads * rounds * per_round * 2, elapsed, all);
+}
+
+// Fragmentation: fill the heap, free most of it at random, then allocate a
+// different size mix, printing RSS against the bytes actually live after each phase
+static void bench_frag(void){
+    const size_t target = (size_t)256 * 1024 * 1024;
+    std::vector<void*> blocks;
+    std::vector<size_t> sizes;
+    blocks.reserve(4 << 20);
+    sizes.reserve(4 << 20);
+    rng random(7);
+    size_t live = 0;
+    uint64_t start = now_ns();
+    uint64_t ops = 0;
+    auto phase = [&](const char *name){
+        printf("frag/%-23s live %8zu KB  rss %8ld KB  rss/live %.2f\n", name, live / 1024,
+               current_rss_kb(), live ? current_rss_kb() * 1024.0 / live : 0.0);
+        fflush(stdout);
+    };
+    // Small and medium blocks
+    while (live < target){
+        size_t size = random.next() % 8 ? random.range(16, 512) : random.range(512, 16384);
+        char *p = (char*)malloc(size);
+        memset(p, 1, size);
+        blocks.push_back(p);
+        sizes.push_back(size);
+        live += size;
+        ops++;
+    }
+    phase("filled");
+    // Free 90% at random
+    for (size_t i = 0; i < blocks.size(); i++){
+        if (random.next() % 10){
+            free(blocks[i]);
+            live -= sizes[i];
+            blocks[i] = nullptr;
+            ops++;
+        }
+    }
+    phase("freed-90%");
+    sleep(1);
+    phase("idle");
+    // Refill with larger blocks, which only fit the holes once neighbours merge
+    size_t refill = live + target / 2;
+    while (live < refill){
+        size_t size = random.range(16384, 65536);
+        char *p = (char*)malloc(size);
+        memset(p, 1, size);
+        blocks.push_back(p);
+        sizes.push_back(size);
+        live += size;
+        ops++;
+    }
+    phase("refilled");
+    for (void *p : blocks){
+        free(p);
+    }
+    ops += blocks.size();
+    live = 0;
+    phase("released");
+    std::vector<uint32_t> none;
+    report("frag", ops, now_ns() - start, none);
+}
+
+struct workload {
+    const char *name;
+    void (*run)(void);
+};
+
+static const workload workloads[] = {
+    { "sizes", bench_sizes },
+    { "threads", bench_threads },
+    { "realloc", bench_realloc },
+    { "larson", bench_larson },
+    { "frag", bench_frag },
+};
+
+// Run a workload in a child process so its peak RSS isn't mixed with the others
+static int run_workload(const workload &w){
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0){
+        w.run();
+        fflush(stdout);
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(child, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv){
+    const char *which = argc > 1 ? argv[1] : "all";
+    int failures = 0;
+    bool found = false;
+    for (const workload &w : workloads){
+        if (strcmp(which, "all") == 0 || strcmp(which, w.name) == 0){
+            failures += run_workload(w);
+            found = true;
+        }
+    }
+    if (!found){
+        fprintf(stderr, "usage: %s [all|sizes|threads|realloc|larson|frag]\n", argv[0]);
+        return 2;
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,11 @@
+#!/bin/sh
+# Build memalloc and the benchmarks, then run the given workloads (default: all)
+# once against glibc and once against memalloc.
+set -e
+cd "$(dirname "$0")/.."
+g++ -O2 -fPIC -shared -o memalloc.so memalloc.cpp -pthread
+g++ -O2 -o bench/bench bench/bench.cpp -pthread
+echo "== glibc"
+./bench/bench "$@"
+echo "== memalloc"
+LD_PRELOAD="$PWD/memalloc.so" ./bench/bench "$@"
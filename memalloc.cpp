@@ -1,211 +1,4636 @@
 #include <cstdlib>
 #include <cstring>
-#include <unistd.h>   // for sbrk
+#include <strings.h>  // for strcasecmp
+#include <cerrno>     // for EINVAL, ENOMEM
+#include <cstdint>    // for uintptr_t, uint64_t
+#include <unistd.h>   // for sysconf, syscall
+#include <sys/syscall.h> // for SYS_mbind
+#include <sys/mman.h> // for mmap, munmap, mremap
 #include <pthread.h>  // for pthread_mutex_t
+#include <sched.h>    // for sched_getcpu, sched_getaffinity
+#include <time.h>     // for clock_gettime, nanosleep
+#include <fcntl.h>    // for open
+#include <signal.h>   // for sigaction, signal, raise
+#include <unwind.h>   // for _Unwind_Backtrace
 #include <cstddef>    // for size_t
+#include <cstdio>     // for snprintf
+#include <cstdarg>    // for va_list
+#include <malloc.h>   // for struct mallinfo2
+#include <atomic>
+#include <new>        // for std::align_val_t
+// Per-CPU caches need restartable sequences as set up by glibc 2.35 and later
+#if defined(__x86_64__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h> // for __rseq_offset, __rseq_size
+#define HAVE_RSEQ 1
+#endif
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h> // for _mm_stream_si128
+#endif
+// USDT probes when instrumented, where systemtap's header is installed
+#if defined(MEMALLOC_INSTRUMENT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>  // for DTRACE_PROBE2
+#define HAVE_SDT 1
+#endif
+#endif
+
+#include "memalloc.h"
+
+// Write a line to stderr without allocating
+// stdio may allocate, which would come back into malloc, so the line is
+// formatted on the stack and handed straight to write.
+static void __attribute__((format(printf, 1, 2))) log_print(const char *fmt, ...){
+    char line[256];
+    va_list args;
+    va_start(args, fmt);
+    int length = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (length > 0){
+        ssize_t written = write(STDERR_FILENO, line, (size_t)length < sizeof(line) ? (size_t)length : sizeof(line) - 1);
+        (void)written;
+    }
+}
 
 #ifdef DEBUG
-#include <cstdio>
-#define DEBUG_PRINT(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+#define DEBUG_PRINT(fmt, ...) log_print(fmt, ##__VA_ARGS__)
 #else
-#define DEBUG_PRINT(fmt, ...) 
+#define DEBUG_PRINT(fmt, ...)
 #endif
 
-typedef char ALIGN[16];
+typedef char ALIGN[32];
 
 // Unions is a data structure where all members share the same memory location.
-union header {
+// The header is padded to 32 bytes so that, as long as every block starts on a
+// 16 byte boundary, the memory handed to the user is 16 byte aligned as well.
+// prev_size is a boundary tag: it lets a block find the header of the block
+// physically before it, so free can merge with free neighbours on both sides.
+union alignas(16) header {
     struct {
         size_t size;
+        size_t prev_size;     // size of the previous physical block, 0 if there is none
         unsigned is_free;
-        union header *next;
+        unsigned short arena; // index of the arena that owns the block
+        unsigned short flags;
+        unsigned sample;      // 1 + index of the block's profiler record, 0 unless it is sampled
+        unsigned check;       // checksum of the fields above, see header_seal
     } s;
-    ALIGN stub; // This is used to align the header to 16 bytes.
+    ALIGN stub; // This is used to pad the header to 32 bytes.
 };
 
 typedef union header header_t;
 
-// Require a pointer to the head and tail of this linked list
-static header_t *head = nullptr;
-static header_t *tail = nullptr;
+// Set on the last block carved from a segment, where the memory after the
+// block is not a header
+#define BLOCK_LAST 0x1
+// Set on blocks that live in a mapping of their own instead of an arena.
+// For these prev_size holds the offset of the header from the start of the
+// mapping, which is only non-zero for over-aligned blocks.
+#define BLOCK_MMAPPED 0x2
+// Set while a block's payload has not been touched since it came from the OS,
+// so it is known to be zero and calloc can skip clearing it
+#define BLOCK_ZEROED 0x4
+// Set on blocks from the bootstrap arena, which are never reused
+#define BLOCK_BOOTSTRAP 0x10
+// Set on blocks placed in front of a guard page, see guard_malloc
+#define BLOCK_GUARDED 0x20
 
-// Mutex to protect the global linked list
-static pthread_mutex_t global_malloc_lock = PTHREAD_MUTEX_INITIALIZER;
+// Header checksums
+// With MEMALLOC_CHECK_HEADERS=1 every header carries a checksum of its
+// address, size, arena and free bit, mixed with a secret picked at startup.
+// The flags and prev_size are left out, as neighbours change them. Headers
+// are sealed wherever the heap changes those fields and checked wherever it
+// trusts them: on free, before merging with a neighbour and before taking a
+// block off a free list. An overflow into the next block is then reported at
+// the next of these instead of crashing later in the free lists.
+static bool check_headers = false;
+static uint64_t header_secret = 0;
 
-// Function to get the free block
-header_t *get_free_block(size_t size){
-    header_t *curr = head;
-    // first fit approach to find the free block (could be optimised)
-    while(curr){
-        if (curr->s.is_free && curr->s.size >= size){
-            return curr;
-        }
-        curr = curr->s.next;
+static inline unsigned header_checksum(const header_t *h){
+    uint64_t x = ((uintptr_t)h ^ header_secret) + h->s.size * 0x9E3779B97F4A7C15ULL;
+    x ^= ((uint64_t)h->s.is_free << 32 | h->s.arena) * 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 31;
+    return (unsigned)(x ^ x >> 32);
+}
+
+static inline void header_seal(header_t *h){
+    if (__builtin_expect(check_headers, 0)){
+        h->s.check = header_checksum(h);
     }
-    return nullptr;
 }
 
-extern "C" {
+// Report a header that doesn't match its checksum and abort
+static void __attribute__((noinline, noreturn)) header_corrupt(const header_t *h){
+    log_print("memalloc: corrupted header of block %p (size %zu), memory before it was overwritten\n",
+              (const void*)(h + 1), h->s.size);
+    abort();
+}
 
-    // Allocates size bytes of memory and returns a pointer to the allocated memory.
-    void* malloc(size_t size){
-        DEBUG_PRINT("malloc: requesting %zu bytes\n", size);
-        // if the requested size is 0, return NULL
-        if (!size){
-            return nullptr;
-        }
+static inline void header_verify(const header_t *h){
+    if (__builtin_expect(check_headers, 0) && h->s.check != header_checksum(h)){
+        header_corrupt(h);
+    }
+}
+
+// Check the header of a block the program is freeing, which must be in use
+static void __attribute__((noinline)) header_verify_release(const header_t *h){
+    header_verify(h);
+    if (h->s.is_free){
+        log_print("memalloc: double free of block %p\n", (const void*)(h + 1));
+        abort();
+    }
+}
+
+// Every block handed out is a multiple of this many bytes
+#define ALIGNMENT 16
+// Bytes in a cache line, data written by different threads is kept this far apart
+#define CACHE_LINE 64
+
+// Size classes
+// Small sizes get one class every 16 bytes up to SMALL_MAX, so every block in
+// a small class has exactly the same size. Above that each power of two is
+// split into CLASS_STEPS geometric classes.
+#define SMALL_MAX 1024
+#define NUM_SMALL_CLASSES (SMALL_MAX / ALIGNMENT)
+#define CLASS_STEPS 4
+#define CLASS_STEPS_LOG2 2
+#define SMALL_MAX_LOG2 10
+#define NUM_CLASSES (NUM_SMALL_CLASSES + (64 - SMALL_MAX_LOG2) * CLASS_STEPS)
+#define BITMAP_WORDS ((NUM_CLASSES + 63) / 64)
+// How many more blocks of its own geometric class a request may look at when
+// no larger class has one, before the heap is grown instead
+#define FIT_SEARCH_STEPS 8
+
+// Free blocks keep their free list links in the payload, which is unused while
+// the block is free. This is why the smallest block has a 16 byte payload.
+#define MIN_BLOCK_SIZE 16
+struct free_links {
+    header_t *next_free;
+    header_t *prev_free;
+};
+
+// Segments
+// Arenas get their memory from large mmap'd segments and carve blocks out of
+// them with a bump pointer, so growing the heap costs a syscall only once per
+// SEGMENT_SIZE bytes and never depends on what else moves the program break.
+// Segments are aligned to their size, so the segment of any block is found
+// by masking its address.
+#define SEGMENT_SIZE ((size_t)64 * 1024 * 1024)
+// Blocks bigger than this always get their own mapping
+#define HEAP_MAX (SEGMENT_SIZE / 2)
+// Trimming releases pages only once this much unused space sits above the bump pointer
+#define TRIM_THRESHOLD (128 * 1024)
+
+struct segment {
+    segment *next;     // the arena's other segments
+    segment *prev;
+    char *bump;        // start of the space not yet carved into blocks
+    char *end;
+    char *dirty_end;   // highest address ever handed out, pages above it are untouched
+    header_t *top;     // the block ending at bump, nullptr if nothing is carved
+    unsigned arena;
+};
+
+// Room left at the start of a segment for its header, keeping blocks 16 byte aligned
+#define SEGMENT_HEADER_SIZE ((sizeof(segment) + 63) & ~(size_t)63)
+
+static inline segment *segment_of(void *ptr){
+    return reinterpret_cast<segment*>((uintptr_t)ptr & ~(SEGMENT_SIZE - 1));
+}
+
+// Huge pages
+// Segments can be backed by 2MB pages, which cuts TLB misses on big heaps.
+// HUGEPAGES_THP asks for transparent huge pages with madvise(MADV_HUGEPAGE).
+// HUGEPAGES_HUGETLB maps segments from the reserved hugetlbfs pool and falls
+// back to transparent huge pages once the pool runs dry. Either way memory
+// is then only given back in whole huge pages, because releasing part of
+// one would make the kernel split it.
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+enum hugepage_mode {
+    HUGEPAGES_OFF = 0,
+    HUGEPAGES_THP,
+    HUGEPAGES_HUGETLB
+};
+static hugepage_mode hugepages = HUGEPAGES_OFF;
+// Trimming and purging release whole multiples of this, a page or a huge page
+static size_t purge_granule = 4096;
+
+static inline char *granule_up(const void *ptr){
+    return (char*)(((uintptr_t)ptr + purge_granule - 1) & ~(purge_granule - 1));
+}
+
+static inline char *granule_down(const void *ptr){
+    return (char*)((uintptr_t)ptr & ~(purge_granule - 1));
+}
+
+// Slabs
+// Objects of up to SLAB_MAX bytes don't get a header. They live in runs,
+// RUN_SIZE byte pieces of one big reserved slab region, and every run holds
+// objects of a single size class. A run's metadata, including a bitmap of its
+// free objects, is kept out of line in slab_runs and found from the object's
+// address, so a 16 byte object really only costs 16 bytes.
+// Each arena owns a SLAB_ARENA_SIZE slice of the region.
+#define SLAB_MAX 256
+#define NUM_SLAB_CLASSES (SLAB_MAX / ALIGNMENT)
+#define RUN_SHIFT 14
+#define RUN_SIZE ((size_t)1 << RUN_SHIFT)
+#define RUN_BITMAP_WORDS (RUN_SIZE / ALIGNMENT / 64)
+#define SLAB_ARENA_SIZE ((size_t)1 << 30)
+#define RUNS_PER_ARENA (SLAB_ARENA_SIZE / RUN_SIZE)
+// Fully free runs an arena keeps before giving their pages back to the OS
+#define SLAB_KEEP_EMPTY 4
+
+struct tcache;
+
+struct slab_run {
+    slab_run *next;         // the partial list of its class, or the arena's empty runs
+    slab_run *prev;
+    tcache *owner;          // the thread the run is private to, see MEMALLOC_THREAD_RUNS
+    unsigned short cls;
+    unsigned short capacity;
+    unsigned short free_count;
+    unsigned short partial; // set while on the partial list of its class
+    uint64_t bitmap[RUN_BITMAP_WORDS]; // one bit per object, set while it is free
+};
+
+// Arenas
+// The heap is split into independent arenas, each with its own lock, block
+// list and free lists, so threads using different arenas never contend.
+// Every block remembers its arena and is always freed back to it.
+#define MAX_ARENAS 64
+
+// Arenas start on a cache line of their own, and the remote free list, which
+// other threads update without the lock, has a line to itself as well
+struct alignas(CACHE_LINE) arena {
+    // Mutex to protect this arena's lists
+    pthread_mutex_t lock;
+    // Blocks freed by threads that don't use this arena, see remote_free_push
+    alignas(CACHE_LINE) std::atomic<void*> remote_frees;
+    // Segments owned by this arena, the one blocks are carved from comes first
+    alignas(CACHE_LINE) segment *segments;
+    // One doubly linked free list per size class, plus a bitmap with one bit
+    // set for every class whose list is not empty
+    header_t *free_lists[NUM_CLASSES];
+    uint64_t free_bitmap[BITMAP_WORDS];
+    // One bit per word of free_bitmap that isn't zero
+    uint64_t free_summary;
+    // Incremented by every purge pass, free spans remember the epoch they were freed in
+    uint64_t purge_epoch;
+    uint64_t last_purge_ms;
+    // Bytes of segments and slab runs this arena has taken from the OS
+    size_t mapped;
+    // Runs of each slab class with at least one free object
+    slab_run *slab_partial[NUM_SLAB_CLASSES];
+    // Fully free runs, ready to be given to any class
+    slab_run *slab_empty;
+    unsigned slab_empty_count;
+    // Runs of this arena's slice of the slab region handed out so far
+    size_t slab_used;
+    unsigned index;
+    // The NUMA node (an index into node_ids) this arena's memory is bound to
+    unsigned node;
+};
+
+static arena arenas[MAX_ARENAS];
+static unsigned num_arenas = 1;
+
+// How threads are spread over the arenas
+enum arena_policy {
+    ARENA_ROUND_ROBIN = 0, // each thread is given the next arena when it first allocates
+    ARENA_PER_CPU          // each slow path uses the arena of the CPU it runs on
+};
+static arena_policy arena_assignment = ARENA_ROUND_ROBIN;
+static __thread arena *thread_arena __attribute__((tls_model("initial-exec")));
+
+// NUMA
+// On machines with more than one memory node every node gets its own share of
+// the arenas, and their segments and slab runs are bound to it with mbind.
+// Threads take an arena of the node they are running on, and blocks freed on
+// another node go back to the arena that owns them instead of being cached
+// and reused far from their memory.
+#define MAX_NODES 64
+#define MAX_CPUS 4096
+#ifndef NODE_SYSFS
+#define NODE_SYSFS "/sys/devices/system/node"
+#endif
+// From <numaif.h>, which only comes with libnuma
+#define MPOL_PREFERRED 1
+
+static unsigned num_nodes = 1;
+static unsigned node_ids[MAX_NODES];          // the kernel's number for each node
+static unsigned char cpu_nodes[MAX_CPUS];     // the node of each CPU
+// Node n owns the node_arena_count[n] arenas from node_first_arena[n] on
+static unsigned node_first_arena[MAX_NODES];
+static unsigned node_arena_count[MAX_NODES];
+static std::atomic<unsigned> node_next_arena[MAX_NODES];
+
+static inline unsigned node_of_cpu(int cpu){
+    return cpu < 0 || cpu >= MAX_CPUS ? 0 : cpu_nodes[cpu];
+}
+
+// The node the calling thread is running on right now
+static inline unsigned current_node(void){
+    return num_nodes > 1 ? node_of_cpu(sched_getcpu()) : 0;
+}
+
+// Prefer the node's memory for a range that hasn't been touched yet.
+// Preferred rather than strictly bound, so a full node falls back to the
+// others instead of failing allocations.
+static void bind_to_node(void *start, size_t length, unsigned node){
+    if (num_nodes < 2 || node_ids[node] >= 64){
+        return;
+    }
+    unsigned long mask = 1UL << node_ids[node];
+    // The kernel reads one bit less than maxnode says
+    syscall(SYS_mbind, start, length, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0);
+}
 
-        // Lock the mutex
-        pthread_mutex_lock(&global_malloc_lock);
-        // Try find an existing free block
-        // Get pointer to the free block
-        header_t* header_ptr = get_free_block(size);
-        if (header_ptr){
-            header_ptr->s.is_free = 0;
-            // Unlock the mutex
-            pthread_mutex_unlock(&global_malloc_lock);
-            // Want to hide the header from the user
-            // Incrementing the pointer by 1 will give the user the memory block
-            // Adding one moves the pointer by the size of one header_t as header_ptr is a pointer to header_t
-            return reinterpret_cast<void*>(header_ptr + 1);
+static size_t page_size = 4096;
+
+static inline size_t page_round(size_t size){
+    return (size + page_size - 1) & ~(page_size - 1);
+}
+
+// Round the requested size up to the block size actually handed out
+static inline size_t align_size(size_t size){
+    return (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+}
+
+// Map an aligned block size to its size class
+static inline unsigned size_class(size_t size){
+    if (size <= SMALL_MAX){
+        return (unsigned)(size / ALIGNMENT) - 1;
+    }
+    // size lies in (2^lg, 2^(lg + 1)], pick which of the CLASS_STEPS slices it is in
+    unsigned lg = 63 - __builtin_clzl(size - 1);
+    unsigned step = ((size - 1) >> (lg - CLASS_STEPS_LOG2)) & (CLASS_STEPS - 1);
+    return NUM_SMALL_CLASSES + (lg - SMALL_MAX_LOG2) * CLASS_STEPS + step;
+}
+
+static inline free_links *links(header_t *block){
+    return reinterpret_cast<free_links*>(block + 1);
+}
+
+// Instrumentation
+// Built with -DMEMALLOC_INSTRUMENT the slow paths are timed, and every thread
+// counts the times in histograms next to its other counters. Bucket b holds
+// the times of at most 2^b nanoseconds that didn't fit in bucket b - 1. The
+// histograms show up in malloc_stats and memalloc_stats_json. Where
+// <sys/sdt.h> is installed the same paths are USDT probes of the memalloc
+// provider as well. Without the flag all of this compiles to nothing.
+enum latency_event {
+    LATENCY_LOCK_WAIT = 0, // waiting for an arena lock another thread held
+    LATENCY_SEGMENT,       // mapping a new heap segment
+    LATENCY_MMAP,          // mapping, resizing or unmapping a block of its own
+    LATENCY_TRIM,          // giving the unused top of a segment back
+    LATENCY_PURGE,         // a purge pass over an arena's free spans
+    NUM_LATENCY_EVENTS
+};
+#define LATENCY_BUCKETS 32
+
+// Names of the events in malloc_stats and the JSON stats
+static const char *const latency_names[NUM_LATENCY_EVENTS] = { "lock_wait", "segment", "mmap", "trim", "purge" };
+
+// Nanoseconds on the monotonic clock, the clock of trace timestamps too
+static uint64_t now_ns(void){
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#ifdef MEMALLOC_INSTRUMENT
+#define INSTRUMENT_START(start) uint64_t start = now_ns()
+#define INSTRUMENT_END(event, start) latency_record(event, now_ns() - (start))
+#define INSTRUMENT_SEARCH(steps) (thread_counters.search_lengths[steps]++)
+#else
+#define INSTRUMENT_START(start)
+#define INSTRUMENT_END(event, start)
+#define INSTRUMENT_SEARCH(steps)
+#endif
+#ifdef HAVE_SDT
+#define MEMALLOC_PROBE(name, a, b) DTRACE_PROBE2(memalloc, name, a, b)
+#else
+#define MEMALLOC_PROBE(name, a, b)
+#endif
+
+// Statistics
+// Every thread counts its own allocations in thread_counters without any
+// synchronisation, and the counters of all threads are only added up when
+// someone asks for them. Sizes are usable sizes, so a block is counted the
+// same when it is allocated and when it is freed.
+enum stats_state {
+    STATS_UNREGISTERED = 0,
+    STATS_REGISTERED,
+    STATS_EXITED // the thread is exiting, its counters have been merged already
+};
+
+struct thread_stats {
+    uint64_t allocs[NUM_CLASSES]; // per size class
+    uint64_t frees[NUM_CLASSES];
+    uint64_t bytes_allocated;
+    uint64_t bytes_freed;
+    uint64_t lock_contended;      // arena locks that were held by someone else
+    uint64_t searches;            // bounded searches of a class list, when no larger class had a block
+    uint64_t search_steps;        // blocks looked at by those searches
+#ifdef MEMALLOC_INSTRUMENT
+    uint64_t latency[NUM_LATENCY_EVENTS][LATENCY_BUCKETS];
+    uint64_t search_lengths[FIT_SEARCH_STEPS + 1]; // searches by the number of blocks they looked at
+#endif
+    thread_stats *next;           // registry of threads that are still running
+    thread_stats *prev;
+    stats_state state;
+};
+
+static __thread thread_stats thread_counters __attribute__((tls_model("initial-exec")));
+
+#ifdef MEMALLOC_INSTRUMENT
+static inline void latency_record(latency_event event, uint64_t ns){
+    unsigned bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    thread_counters.latency[event][bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+}
+#endif
+
+// Blocks with a mapping of their own, these only change on slow paths
+static std::atomic<size_t> mmap_bytes(0);
+static std::atomic<size_t> mmap_count(0);
+
+static void stats_register(thread_stats *st);
+
+// Count an allocation of a block with size usable bytes
+static inline void stat_alloc(size_t size){
+    thread_stats *st = &thread_counters;
+    if (__builtin_expect(st->state == STATS_UNREGISTERED, 0)){
+        stats_register(st);
+    }
+    st->allocs[size_class(size)]++;
+    st->bytes_allocated += size;
+}
+
+// Count freeing a block with size usable bytes
+static inline void stat_free(size_t size){
+    thread_stats *st = &thread_counters;
+    if (__builtin_expect(st->state == STATS_UNREGISTERED, 0)){
+        stats_register(st);
+    }
+    st->frees[size_class(size)]++;
+    st->bytes_freed += size;
+}
+
+// Count a block that changed size without moving
+// A block that changed class moves to the new one, as if it had been freed
+// and allocated again, so its later free is counted in the class it is in.
+static inline void stat_resize(size_t old_size, size_t new_size){
+    thread_stats *st = &thread_counters;
+    if (__builtin_expect(st->state == STATS_UNREGISTERED, 0)){
+        stats_register(st);
+    }
+    unsigned old_cls = size_class(old_size);
+    unsigned new_cls = size_class(new_size);
+    if (old_cls != new_cls){
+        st->frees[old_cls]++;
+        st->allocs[new_cls]++;
+    }
+    if (new_size > old_size){
+        st->bytes_allocated += new_size - old_size;
+    } else {
+        st->bytes_freed += old_size - new_size;
+    }
+}
+
+// Purging
+// Free blocks of at least PURGE_MIN bytes are spans worth giving back to the
+// OS. Their payload also records the arena's purge epoch at the time they were
+// freed. A purge pass, run at most once per purge_decay_ms, releases the
+// pages of every span that has been free since before the previous pass with
+// madvise, so memory freed recently stays resident for reuse.
+#define PURGE_MIN (64 * 1024)
+// Epoch of spans whose pages have already been released
+#define PURGE_DONE UINT64_MAX
+#define DEFAULT_PURGE_DECAY_MS 10000
+
+struct free_span {
+    free_links links;
+    uint64_t epoch;
+};
+
+static uint64_t purge_decay_ms = DEFAULT_PURGE_DECAY_MS;
+
+static inline free_span *span(header_t *block){
+    return reinterpret_cast<free_span*>(block + 1);
+}
+
+// Push a block on the front of the free list for its size class
+static void free_list_insert(arena *a, header_t *block){
+    unsigned cls = size_class(block->s.size);
+    free_links *l = links(block);
+    l->prev_free = nullptr;
+    l->next_free = a->free_lists[cls];
+    if (a->free_lists[cls]){
+        links(a->free_lists[cls])->prev_free = block;
+    }
+    a->free_lists[cls] = block;
+    a->free_bitmap[cls / 64] |= (uint64_t)1 << (cls % 64);
+    a->free_summary |= (uint64_t)1 << (cls / 64);
+    if (block->s.size >= PURGE_MIN){
+        span(block)->epoch = a->purge_epoch;
+    }
+}
+
+// Unlink a block from anywhere in its free list in constant time
+static void free_list_remove(arena *a, header_t *block){
+    unsigned cls = size_class(block->s.size);
+    free_links *l = links(block);
+    if (l->prev_free){
+        links(l->prev_free)->next_free = l->next_free;
+    } else {
+        a->free_lists[cls] = l->next_free;
+    }
+    if (l->next_free){
+        links(l->next_free)->prev_free = l->prev_free;
+    }
+    if (!a->free_lists[cls]){
+        a->free_bitmap[cls / 64] &= ~((uint64_t)1 << (cls % 64));
+        if (!a->free_bitmap[cls / 64]){
+            a->free_summary &= ~((uint64_t)1 << (cls / 64));
         }
+    }
+}
 
-        // No existing free block found
-        // Allocate memory using sbrk
+// Find the first size class at or above cls with a non-empty free list
+// Two levels of bitmaps, so this is a couple of bit scans whatever the heap holds.
+static int next_nonempty_class(arena *a, unsigned cls){
+    unsigned word = cls / 64;
+    if (word >= BITMAP_WORDS){
+        return -1;
+    }
+    uint64_t bits = a->free_bitmap[word] & (~(uint64_t)0 << (cls % 64));
+    if (bits){
+        return (int)(word * 64 + __builtin_ctzl(bits));
+    }
+    uint64_t words = a->free_summary & (~(uint64_t)0 << (word + 1));
+    if (!words){
+        return -1;
+    }
+    word = __builtin_ctzl(words);
+    return (int)(word * 64 + __builtin_ctzl(a->free_bitmap[word]));
+}
 
-        size_t total_size = sizeof(header_t) + size;
-        void *block = sbrk(total_size);
-        // If sbrk fails, return NULL
-        if (block == (void*) -1){
-            // Unlock the mutex
-            pthread_mutex_unlock(&global_malloc_lock);
-            return NULL;
+// Function to get the free block
+// Every block in a small class has the same size, so the head of the list is
+// always a fit. Geometric classes cover a range of sizes, so only the head of
+// the request's own class is tried, then any block of a larger class, which
+// is bound to fit. Only if there is none are up to FIT_SEARCH_STEPS more
+// blocks of the own class looked at. Like TLSF, every lookup takes a bounded
+// number of steps however many free blocks there are.
+header_t *get_free_block(arena *a, size_t size){
+    unsigned cls = size_class(size);
+    header_t *block = a->free_lists[cls];
+    if (block){
+        header_verify(block);
+    }
+    if (block && block->s.size >= size){
+        free_list_remove(a, block);
+        return block;
+    }
+    int found = next_nonempty_class(a, cls + 1);
+    if (found >= 0){
+        block = a->free_lists[found];
+        header_verify(block);
+        free_list_remove(a, block);
+        return block;
+    }
+    if (!block){
+        return nullptr;
+    }
+    thread_counters.searches++;
+    block = links(block)->next_free;
+    unsigned steps = 0;
+    for (; block && steps < FIT_SEARCH_STEPS; steps++){
+        thread_counters.search_steps++;
+        header_verify(block);
+        if (block->s.size >= size){
+            free_list_remove(a, block);
+            INSTRUMENT_SEARCH(steps + 1);
+            MEMALLOC_PROBE(search, a->index, steps + 1);
+            return block;
         }
+        block = links(block)->next_free;
+    }
+    INSTRUMENT_SEARCH(steps);
+    MEMALLOC_PROBE(search, a->index, steps);
+    return nullptr;
+}
+
+// Physical neighbours of a block
+static inline header_t *next_block(header_t *block){
+    return reinterpret_cast<header_t*>((char*)(block + 1) + block->s.size);
+}
+
+static inline header_t *prev_block(header_t *block){
+    return reinterpret_cast<header_t*>((char*)block - block->s.prev_size) - 1;
+}
+
+// Turn count blocks of the given size at the segment's bump pointer into
+// headers and move the bump pointer past them. Returns the first block.
+// Must be called with the arena lock held.
+static header_t *carve_blocks(segment *seg, size_t size, unsigned count){
+    size_t block_size = sizeof(header_t) + size;
+    header_t *first = reinterpret_cast<header_t*>(seg->bump);
 
+    // The new blocks directly follow the segment's top block, so they can
+    // later be merged with it
+    size_t prev_size = 0;
+    if (seg->top){
+        seg->top->s.flags &= ~BLOCK_LAST;
+        prev_size = seg->top->s.size;
+    }
+    // Nothing above dirty_end has ever been written
+    char *clean = seg->dirty_end;
+
+    for (unsigned i = 0; i < count; i++){
         // Create a header for the new block
-        header_ptr = reinterpret_cast<header_t*>(block);
+        header_t *header_ptr = reinterpret_cast<header_t*>((char*)first + i * block_size);
         header_ptr->s.size = size; // size of the block requested by the user (excluding the header)
+        header_ptr->s.prev_size = prev_size;
         header_ptr->s.is_free = 0; // block is not free
-        header_ptr->s.next = nullptr; // Added to the end of the linked list therefore next is null
+        header_ptr->s.arena = seg->arena;
+        header_ptr->s.flags = (i == count - 1) ? BLOCK_LAST : 0;
+        header_ptr->s.sample = 0;
+        if ((char*)(header_ptr + 1) >= clean){
+            header_ptr->s.flags |= BLOCK_ZEROED;
+        }
+        header_seal(header_ptr);
+        prev_size = size;
+        seg->top = header_ptr;
+    }
 
-        // If head is null, this is the first block
-        if (!head){
-            head = header_ptr;
+    seg->bump += block_size * count;
+    if (seg->bump > seg->dirty_end){
+        seg->dirty_end = seg->bump;
+    }
+    return first;
+}
+
+// Map SEGMENT_SIZE bytes aligned to SEGMENT_SIZE, nullptr on failure
+// Over-map so that an aligned range can be cut out of the middle.
+// Pages are only backed by memory once the bump pointer reaches them.
+static char *segment_map(void){
+    size_t length = 2 * SEGMENT_SIZE;
+    char *memory = (char*)mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED){
+        return nullptr;
+    }
+    char *start = (char*)(((uintptr_t)memory + SEGMENT_SIZE - 1) & ~(SEGMENT_SIZE - 1));
+    if (start > memory){
+        munmap(memory, start - memory);
+    }
+    munmap(start + SEGMENT_SIZE, memory + length - (start + SEGMENT_SIZE));
+    return start;
+}
+
+// Map a segment from the hugetlbfs pool, nullptr if the pool can't cover it
+// The whole segment is reserved from the pool up front, so running out shows
+// up here and not as a SIGBUS on some later page fault.
+static char *segment_map_hugetlb(void){
+    char *start = segment_map();
+    if (!start){
+        return nullptr;
+    }
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB;
+#ifdef MAP_HUGE_SHIFT
+    flags |= 21 << MAP_HUGE_SHIFT; // 2MB pages even if the default size is another
+#endif
+    if (mmap(start, SEGMENT_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0) == MAP_FAILED){
+        munmap(start, SEGMENT_SIZE);
+        return nullptr;
+    }
+    return start;
+}
+
+// Map a new segment and make it the one the arena carves blocks from
+// Must be called with the arena lock held.
+static segment *segment_create(arena *a){
+    INSTRUMENT_START(start_ns);
+    char *start = nullptr;
+    if (hugepages == HUGEPAGES_HUGETLB){
+        start = segment_map_hugetlb();
+    }
+    if (!start){
+        start = segment_map();
+        if (!start){
+            return nullptr;
         }
+        if (hugepages != HUGEPAGES_OFF){
+            madvise(start, SEGMENT_SIZE, MADV_HUGEPAGE);
+        }
+    }
+    // Before the header below touches the first page
+    bind_to_node(start, SEGMENT_SIZE, a->node);
 
-        // If tail is not null, set the next block of the tail to the new block
-        if (tail){
-            tail->s.next = header_ptr;
+    segment *seg = reinterpret_cast<segment*>(start);
+    seg->bump = start + SEGMENT_HEADER_SIZE;
+    seg->end = start + SEGMENT_SIZE;
+    seg->dirty_end = seg->bump;
+    seg->top = nullptr;
+    seg->arena = a->index;
+    seg->prev = nullptr;
+    seg->next = a->segments;
+    if (a->segments){
+        a->segments->prev = seg;
+    }
+    a->segments = seg;
+    a->mapped += SEGMENT_SIZE;
+    INSTRUMENT_END(LATENCY_SEGMENT, start_ns);
+    MEMALLOC_PROBE(segment_map, a->index, SEGMENT_SIZE);
+    return seg;
+}
+
+// Unmap a segment that no longer holds any used block
+// Must be called with the arena lock held.
+static void segment_destroy(arena *a, segment *seg){
+    if (seg->prev){
+        seg->prev->next = seg->next;
+    } else {
+        a->segments = seg->next;
+    }
+    if (seg->next){
+        seg->next->prev = seg->prev;
+    }
+    munmap(seg, SEGMENT_SIZE);
+    a->mapped -= SEGMENT_SIZE;
+}
+
+static void heap_free(arena *a, header_t *header_ptr);
+
+// The arena has moved on to a new segment, so whatever is left at the end of
+// the old one becomes an ordinary free block
+// Must be called with the arena lock held.
+static void segment_retire(arena *a, segment *seg){
+    size_t leftover = seg->end - seg->bump;
+    if (leftover < sizeof(header_t) + MIN_BLOCK_SIZE){
+        return;
+    }
+    heap_free(a, carve_blocks(seg, leftover - sizeof(header_t), 1));
+}
+
+// Carve up to count new blocks of the given size out of the arena's current
+// segment, mapping a new segment when it is full. The blocks are physically
+// contiguous and count is set to how many were carved. Returns the first
+// block, or nullptr if no memory is left.
+// Must be called with the arena lock held.
+static header_t *heap_grow(arena *a, size_t size, unsigned *count){
+    size_t block_size = sizeof(header_t) + size;
+    segment *seg = a->segments;
+    if (!seg || (size_t)(seg->end - seg->bump) < block_size){
+        segment *fresh = segment_create(a);
+        if (!fresh){
+            return nullptr;
         }
+        if (seg){
+            segment_retire(a, seg);
+        }
+        seg = fresh;
+        if ((size_t)(seg->end - seg->bump) < block_size){
+            return nullptr;
+        }
+    }
 
-        tail = header_ptr;
+    // Take as many of the blocks as fit
+    size_t room = (seg->end - seg->bump) / block_size;
+    if (*count > room){
+        *count = (unsigned)room;
+    }
+    return carve_blocks(seg, size, *count);
+}
 
-        // Unlock the mutex
-        pthread_mutex_unlock(&global_malloc_lock);
+// Hand the pages above the bump pointer back to the OS once enough of them are unused
+// With huge pages the fault that touched dirty_end brought in the rest of its
+// huge page too, so that goes as well. One huge page above the bump pointer is
+// kept, or a heap going up and down across a boundary would fault in and
+// clear 2MB every time.
+static void segment_trim(segment *seg){
+    size_t slack = purge_granule > page_size ? purge_granule : 0;
+    char *unused = granule_up(seg->bump + slack);
+    char *dirty = granule_up(seg->dirty_end);
+    if (dirty > unused && (size_t)(dirty - unused) >= TRIM_THRESHOLD){
+        INSTRUMENT_START(start_ns);
+        madvise(unused, dirty - unused, MADV_DONTNEED);
+        seg->dirty_end = unused;
+        INSTRUMENT_END(LATENCY_TRIM, start_ns);
+        MEMALLOC_PROBE(trim, seg->arena, (size_t)(dirty - unused));
+    }
+}
 
-        // Return the memory block to the user (shift header_ptr by one to hide the header)
-        return reinterpret_cast<void*>(header_ptr + 1);
+// Shrink a block to size bytes if what is left over can hold a block of its
+// own. Returns the leftover as a used block, or nullptr if there was no split.
+// Must be called with the arena lock held.
+static header_t *split_off(header_t *block, size_t size){
+    if (block->s.size < size + sizeof(header_t) + MIN_BLOCK_SIZE){
+        return nullptr;
     }
+    header_t *rest = reinterpret_cast<header_t*>((char*)(block + 1) + size);
+    rest->s.size = block->s.size - size - sizeof(header_t);
+    rest->s.prev_size = size;
+    rest->s.is_free = 0;
+    rest->s.arena = block->s.arena;
+    rest->s.flags = block->s.flags & BLOCK_LAST;
+    rest->s.sample = 0;
 
-    // Frees memory block
-    // First check if the block is at the end of the heap and can be released
-    // If not, mark the block as free
-    void free(void *block){
-        DEBUG_PRINT("free: freeing block %p\n", block);
-        if (!block){
-            return;
+    block->s.size = size;
+    block->s.flags &= ~BLOCK_LAST;
+    header_seal(rest);
+    header_seal(block);
+    if (rest->s.flags & BLOCK_LAST){
+        segment_of(rest)->top = rest;
+    } else {
+        next_block(rest)->s.prev_size = rest->s.size;
+    }
+    return rest;
+}
+
+// Split a block that came off a free list and hand the leftover back to the
+// free lists. The block's neighbours can't be free, so there is nothing to merge.
+// Must be called with the arena lock held.
+static void split_block(arena *a, header_t *block, size_t size){
+    header_t *rest = split_off(block, size);
+    if (rest){
+        rest->s.is_free = 1;
+        header_seal(rest);
+        free_list_insert(a, rest);
+    }
+}
+
+// Merge the block physically after block into it
+// Must be called with the arena lock held.
+static void absorb_next(header_t *block){
+    header_t *next = next_block(block);
+    block->s.size += sizeof(header_t) + next->s.size;
+    block->s.flags |= next->s.flags & BLOCK_LAST;
+    header_seal(block);
+    if (block->s.flags & BLOCK_LAST){
+        segment_of(block)->top = block;
+    } else {
+        next_block(block)->s.prev_size = block->s.size;
+    }
+}
+
+// Milliseconds on a clock that only moves forward
+// The coarse clock is read from the vDSO without a syscall.
+static uint64_t now_ms(void){
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Release the pages of every free span that was already free at the last pass.
+// The page holding a span's links stays, so it remains on its free list.
+// With huge pages only the whole huge pages inside a span are released.
+// Must be called with the arena lock held.
+static void heap_purge(arena *a){
+    INSTRUMENT_START(start_ns);
+    uint64_t epoch = a->purge_epoch++;
+    int cls = next_nonempty_class(a, size_class(PURGE_MIN));
+    while (cls >= 0){
+        for (header_t *block = a->free_lists[cls]; block; block = links(block)->next_free){
+            if (block->s.size < PURGE_MIN || span(block)->epoch >= epoch){
+                continue;
+            }
+            char *start = granule_up(span(block) + 1);
+            char *end = granule_down((char*)(block + 1) + block->s.size);
+            if (end > start){
+                madvise(start, end - start, MADV_DONTNEED);
+            }
+            span(block)->epoch = PURGE_DONE;
         }
+        cls = next_nonempty_class(a, cls + 1);
+    }
+    INSTRUMENT_END(LATENCY_PURGE, start_ns);
+    MEMALLOC_PROBE(purge, a->index, epoch);
+}
+
+// Run a purge pass if the last one is at least purge_decay_ms old
+// Must be called with the arena lock held.
+static void heap_maybe_purge(arena *a){
+    uint64_t now = now_ms();
+    if (now - a->last_purge_ms < purge_decay_ms){
+        return;
+    }
+    a->last_purge_ms = now;
+    heap_purge(a);
+}
 
-        // lock the mutex
-        pthread_mutex_lock(&global_malloc_lock);
+// Find or create a block of the given (aligned) size.
+// Must be called with the arena lock held.
+static header_t *heap_alloc(arena *a, size_t size){
+    // Try find an existing free block
+    // Get pointer to the free block
+    header_t* header_ptr = get_free_block(a, size);
+    if (header_ptr){
+        header_ptr->s.is_free = 0;
+        header_seal(header_ptr);
+        // Don't waste the rest of a large block on a small request
+        split_block(a, header_ptr, size);
+        return header_ptr;
+    }
 
-        // Get the pointer to the header of the block
-        header_t* header_ptr = reinterpret_cast<header_t*>(block) - 1;
+    // No existing free block found
+    // Carve a new one out of the current segment
+    unsigned count = 1;
+    return heap_grow(a, size, &count);
+}
 
-        void *programbreak = sbrk(0); // Current value of program break
+// Give a block back to the heap
+// The block is merged with free physical neighbours first, so any run of
+// free blocks at the top of a segment has become one block. Then check if it
+// is the last block carved from the current segment, and if so give it back
+// to the bump pointer in one step. A segment the arena has moved on from is
+// unmapped once it is entirely free. Otherwise mark the block as free and put
+// it on the free list of its size class.
+// Every step is constant time: neighbours are found through the boundary tags
+// and the segment through the block's address.
+// Must be called with the lock of the arena owning the block held.
+static void heap_free(arena *a, header_t *header_ptr){
+    // Coalesce with the following block
+    if (!(header_ptr->s.flags & BLOCK_LAST)){
+        header_t *next = next_block(header_ptr);
+        header_verify(next);
+        if (next->s.is_free){
+            free_list_remove(a, next);
+            absorb_next(header_ptr);
+        }
+    }
+    // Coalesce with the preceding block
+    if (header_ptr->s.prev_size){
+        header_t *prev = prev_block(header_ptr);
+        header_verify(prev);
+        if (prev->s.is_free){
+            free_list_remove(a, prev);
+            absorb_next(prev);
+            header_ptr = prev;
+        }
+    }
 
-        // if the block is at the end of the heap, release it
-        if ((char*)block + header_ptr->s.size == programbreak){
-            if (head == tail){
-                head = tail = nullptr;
+    if (header_ptr->s.flags & BLOCK_LAST){
+        segment *seg = segment_of(header_ptr);
+        // if the block is at the end of the used part of the current segment, release it
+        if (seg == a->segments){
+            // The block before it becomes the top, if there is one
+            if (header_ptr->s.prev_size){
+                seg->top = prev_block(header_ptr);
+                seg->top->s.flags |= BLOCK_LAST;
             } else {
-                header_t *temp = head;
-                while(temp){
-                    // If next block is the tail, set the next block to null and set the tail to the current block
-                    if (temp->s.next == tail){
-                        temp->s.next = nullptr;
-                        tail = temp;
-                        break;
-                    }
-                    // Move to the next block
-                    temp = temp->s.next;
-                }
+                seg->top = nullptr;
             }
-            // Decrease the program break by the size of the block
-            sbrk(0 - sizeof(header_t) - header_ptr->s.size);
-            // Unlock the mutex
-            pthread_mutex_unlock(&global_malloc_lock);
+            // Move the bump pointer back over the block
+            seg->bump = (char*)header_ptr;
+            segment_trim(seg);
             return;
         }
+        // if the block is all that was carved from an old segment, unmap it
+        if (!header_ptr->s.prev_size){
+            segment_destroy(a, seg);
+            return;
+        }
+    }
 
-        // The block is not at the end of the heap
-        // Mark the block as free
-        header_ptr->s.is_free = 1;
-
-        // unlock the mutex
-        pthread_mutex_unlock(&global_malloc_lock);
+    // The block is not at the end of a segment
+    // Mark the block as free
+    header_ptr->s.is_free = 1;
+    header_ptr->s.flags &= ~BLOCK_ZEROED;
+    header_seal(header_ptr);
+    free_list_insert(a, header_ptr);
+    // Only freeing a span adds memory worth purging, so that's when to check
+    if (header_ptr->s.size >= PURGE_MIN){
+        heap_maybe_purge(a);
     }
+}
 
-    // Allocates memory for an array of num elements of nsize bytes each and returns a pointer to the allocated memory
-    void* calloc(size_t num, size_t nsize){
-        DEBUG_PRINT("calloc: requesting %zu bytes\n", num * nsize);
-        if (!num || !nsize){
-            return nullptr;
+// Resize a used block without moving it, for realloc.
+// Shrinking gives the tail end back as a free block. Growing takes over the
+// next block if it is free, and extends the bump pointer if the block (or the
+// free block after it) is the top of the current segment.
+// Returns false if the block can't grow in place.
+// Must be called with the lock of the arena owning the block held.
+static bool heap_resize(arena *a, header_t *block, size_t size){
+    if (size <= block->s.size){
+        header_t *rest = split_off(block, size);
+        if (rest){
+            // The leftover may border a free block, so free it properly
+            heap_free(a, rest);
         }
+        return true;
+    }
 
-        size_t size = num * nsize;
-
-        // Check for overflow
-        if (nsize != size / num){
-            return NULL;
+    // Work out what growing in place would give before changing anything
+    size_t available = block->s.size;
+    header_t *next = nullptr;
+    bool is_top = block->s.flags & BLOCK_LAST;
+    if (!is_top){
+        next = next_block(block);
+        header_verify(next);
+        if (!next->s.is_free){
+            return false;
         }
+        available += sizeof(header_t) + next->s.size;
+        is_top = next->s.flags & BLOCK_LAST;
+    }
+    segment *seg = segment_of(block);
+    size_t spare = (is_top && seg == a->segments) ? (size_t)(seg->end - seg->bump) : 0;
+    if (available + spare < size){
+        return false;
+    }
 
-        void *block = malloc(size);
-        if (!block){
-            return nullptr;
+    if (next){
+        free_list_remove(a, next);
+        absorb_next(block);
+    }
+    if (block->s.size < size){
+        // Extend the top block by bumping the segment
+        seg->bump += size - block->s.size;
+        if (seg->bump > seg->dirty_end){
+            seg->dirty_end = seg->bump;
         }
+        block->s.size = size;
+        header_seal(block);
+    } else {
+        split_block(a, block, size);
+    }
+    return true;
+}
 
-        // set the memory block to zero
-        memset(block, 0, size);
+// Find a block whose payload is aligned to alignment bytes.
+// A block with enough slack is taken, the part before the aligned address
+// becomes a free block of its own and the excess at the end is split off.
+// Must be called with the arena lock held.
+static header_t *heap_alloc_aligned(arena *a, size_t alignment, size_t size){
+    // The leading part needs room for a header and a minimal payload
+    size_t lead_min = sizeof(header_t) + MIN_BLOCK_SIZE;
+    header_t *block = heap_alloc(a, size + alignment + lead_min);
+    if (!block){
+        return nullptr;
+    }
+    uintptr_t payload = (uintptr_t)(block + 1);
+    if (!(payload & (alignment - 1))){
+        header_t *rest = split_off(block, size);
+        if (rest){
+            heap_free(a, rest);
+        }
         return block;
+    }
 
+    uintptr_t aligned = (payload + lead_min + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    header_t *result = reinterpret_cast<header_t*>(aligned) - 1;
+    size_t lead = (char*)result - (char*)(block + 1);
+
+    result->s.size = block->s.size - lead - sizeof(header_t);
+    result->s.prev_size = lead;
+    result->s.is_free = 0;
+    result->s.arena = block->s.arena;
+    // The aligned payload lies inside the old one, so it is still zero if that was
+    result->s.flags = block->s.flags & (BLOCK_LAST | BLOCK_ZEROED);
+    result->s.sample = 0;
+    block->s.size = lead;
+    block->s.flags &= ~BLOCK_LAST;
+    header_seal(result);
+    header_seal(block);
+    if (result->s.flags & BLOCK_LAST){
+        segment_of(result)->top = result;
+    } else {
+        next_block(result)->s.prev_size = result->s.size;
     }
+    // The leading part may border a free block, so free it properly
+    heap_free(a, block);
 
-    // Change the size of the given memory block to the size given
-    void* realloc(void *block, size_t size){
-        DEBUG_PRINT("realloc: requesting %zu bytes\n", size);
-        if (!block || !size){
-            // if block is null, call malloc
-            // if size is 0, malloc will handle it
-            return malloc(size);
-        }
-        
-        // Get the header of the block
-        header_t *header_ptr = reinterpret_cast<header_t*>(block) - 1;
+    header_t *rest = split_off(result, size);
+    if (rest){
+        heap_free(a, rest);
+    }
+    return result;
+}
 
-        // If the size of the block is greater than the requested size, return the block
-        if (header_ptr->s.size >= size){
-            return block;
-        }
+// Large allocations
+// Requests of at least mmap_threshold bytes get a mapping of their own, so
+// they can always be given back to the OS no matter where they are.
+#define DEFAULT_MMAP_THRESHOLD (128 * 1024)
 
-        // Allocate a new block of correct size
-        void *new_block = malloc(size);
-        if (new_block){
-            // copy the contents of the old block to the new block
-            memcpy(new_block, block, header_ptr->s.size);
-            // free the old block
-            free(block);
-        }
-        return new_block;
+static size_t mmap_threshold = DEFAULT_MMAP_THRESHOLD;
+
+static void set_mmap_threshold(size_t threshold){
+    // Mapped blocks must never be mistaken for thread cache blocks
+    mmap_threshold = threshold <= SMALL_MAX ? SMALL_MAX + 1 : threshold;
+}
+
+// Map a block whose payload is aligned to alignment bytes
+static header_t *mmap_alloc(size_t size, size_t alignment){
+    // Room to slide the header forward until the payload is aligned
+    size_t slack = alignment > ALIGNMENT ? alignment : 0;
+    size_t length = page_round(sizeof(header_t) + size + slack);
+    if (length < size){
+        return nullptr;
+    }
+    INSTRUMENT_START(start_ns);
+    char *memory = (char*)mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    INSTRUMENT_END(LATENCY_MMAP, start_ns);
+    MEMALLOC_PROBE(mmap, memory, length);
+    if (memory == MAP_FAILED){
+        return nullptr;
+    }
+    // Blocks big enough to hold a huge page get them too, mremap keeps the advice
+    if (hugepages != HUGEPAGES_OFF && length >= 2 * HUGE_PAGE_SIZE){
+        madvise(memory, length, MADV_HUGEPAGE);
     }
-}
\ No newline at end of file
+    uintptr_t payload = ((uintptr_t)memory + sizeof(header_t) + slack) & ~(uintptr_t)(slack ? alignment - 1 : 0);
+    header_t *header_ptr = reinterpret_cast<header_t*>(payload) - 1;
+    size_t offset = (char*)header_ptr - memory;
+    // The whole mapping past the header is usable
+    header_ptr->s.size = length - offset - sizeof(header_t);
+    header_ptr->s.prev_size = offset;
+    header_ptr->s.is_free = 0;
+    header_ptr->s.arena = 0;
+    header_ptr->s.flags = BLOCK_MMAPPED | BLOCK_ZEROED;
+    header_ptr->s.sample = 0;
+    header_seal(header_ptr);
+    mmap_bytes.fetch_add(length, std::memory_order_relaxed);
+    mmap_count.fetch_add(1, std::memory_order_relaxed);
+    return header_ptr;
+}
+
+static void mmap_free(header_t *header_ptr){
+    size_t offset = header_ptr->s.prev_size;
+    size_t length = offset + sizeof(header_t) + header_ptr->s.size;
+    INSTRUMENT_START(start_ns);
+    munmap((char*)header_ptr - offset, length);
+    INSTRUMENT_END(LATENCY_MMAP, start_ns);
+    MEMALLOC_PROBE(munmap, header_ptr, length);
+    mmap_bytes.fetch_sub(length, std::memory_order_relaxed);
+    mmap_count.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// Resize a mapped block, letting the kernel move the pages instead of copying them
+static header_t *mmap_resize(header_t *header_ptr, size_t size){
+    size_t offset = header_ptr->s.prev_size;
+    size_t old_length = offset + sizeof(header_t) + header_ptr->s.size;
+    size_t length = page_round(offset + sizeof(header_t) + size);
+    if (length < size){
+        return nullptr;
+    }
+    if (length == old_length){
+        return header_ptr;
+    }
+    INSTRUMENT_START(start_ns);
+    char *memory = (char*)mremap((char*)header_ptr - offset, old_length, length, MREMAP_MAYMOVE);
+    INSTRUMENT_END(LATENCY_MMAP, start_ns);
+    MEMALLOC_PROBE(mremap, header_ptr, length);
+    if (memory == MAP_FAILED){
+        return nullptr;
+    }
+    header_ptr = reinterpret_cast<header_t*>(memory + offset);
+    header_ptr->s.size = length - offset - sizeof(header_t);
+    header_seal(header_ptr);
+    mmap_bytes.fetch_add(length - old_length, std::memory_order_relaxed);
+    return header_ptr;
+}
+
+// Recycled blocks at least this big are cleared with streaming stores
+#define STREAMING_CLEAR_MIN (256 * 1024)
+
+// Zero a large block without pulling it through the cache, which would evict
+// everything else for memory the caller may not touch again soon.
+// block is 16 byte aligned and size a multiple of 16.
+static void clear_large(void *block, size_t size){
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i *p = static_cast<__m128i*>(block);
+    __m128i *end = reinterpret_cast<__m128i*>((char*)block + size);
+    while (p + 4 <= end){
+        _mm_stream_si128(p, zero);
+        _mm_stream_si128(p + 1, zero);
+        _mm_stream_si128(p + 2, zero);
+        _mm_stream_si128(p + 3, zero);
+        p += 4;
+    }
+    while (p < end){
+        _mm_stream_si128(p++, zero);
+    }
+    // Streaming stores are weakly ordered, make them visible before returning
+    _mm_sfence();
+#else
+    memset(block, 0, size);
+#endif
+}
+
+// Slab region
+// Base and length of the reserved region, both stay zero if slabs are unavailable
+static char *slab_base = nullptr;
+static size_t slab_span = 0;
+// Metadata of every run in the region, in address order
+static slab_run *slab_runs = nullptr;
+
+// Reserve address space for the slab region and the metadata of its runs.
+// Nothing is committed until it is touched. If either reservation fails small
+// objects simply keep using the heap.
+static void slab_reserve(void){
+    size_t span = (size_t)num_arenas * SLAB_ARENA_SIZE;
+    size_t meta = page_round((size_t)num_arenas * RUNS_PER_ARENA * sizeof(slab_run));
+    void *region = mmap(nullptr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED){
+        return;
+    }
+    void *runs = mmap(nullptr, meta, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (runs == MAP_FAILED){
+        munmap(region, span);
+        return;
+    }
+    slab_runs = static_cast<slab_run*>(runs);
+    slab_base = static_cast<char*>(region);
+    slab_span = span;
+    for (unsigned i = 0; i < num_arenas; i++){
+        bind_to_node(slab_base + (size_t)i * SLAB_ARENA_SIZE, SLAB_ARENA_SIZE, arenas[i].node);
+    }
+}
+
+// True if ptr points into the slab region
+// One unsigned comparison, with no region slab_span is 0 and this is always false
+static inline bool is_slab(const void *ptr){
+    return (uintptr_t)ptr - (uintptr_t)slab_base < slab_span;
+}
+
+// The run holding a slab object
+static inline slab_run *run_of(const void *ptr){
+    return &slab_runs[((uintptr_t)ptr - (uintptr_t)slab_base) >> RUN_SHIFT];
+}
+
+// The first object of a run
+static inline char *run_memory(slab_run *run){
+    return slab_base + ((size_t)(run - slab_runs) << RUN_SHIFT);
+}
+
+// The arena whose slice holds a slab object
+static inline arena *slab_arena(const void *ptr){
+    return &arenas[((uintptr_t)ptr - (uintptr_t)slab_base) / SLAB_ARENA_SIZE];
+}
+
+// Usable size of a slab object
+static inline size_t slab_size(const void *ptr){
+    return (size_t)(run_of(ptr)->cls + 1) * ALIGNMENT;
+}
+
+// The partial list of class cls in arena a, or that of owner for runs private to a thread
+static inline slab_run **slab_partial_list(arena *a, unsigned cls, tcache *owner);
+
+static void slab_partial_push(arena *a, slab_run *run){
+    slab_run **list = slab_partial_list(a, run->cls, run->owner);
+    run->prev = nullptr;
+    run->next = *list;
+    if (run->next){
+        run->next->prev = run;
+    }
+    *list = run;
+    run->partial = 1;
+}
+
+static void slab_partial_remove(arena *a, slab_run *run){
+    if (run->prev){
+        run->prev->next = run->next;
+    } else {
+        *slab_partial_list(a, run->cls, run->owner) = run->next;
+    }
+    if (run->next){
+        run->next->prev = run->prev;
+    }
+    run->partial = 0;
+}
+
+// Set up an unused run for class cls and put it on the partial list of the
+// class, that of owner if the run is to be private to a thread
+// Returns nullptr once the arena's slice is used up
+static slab_run *slab_new_run(arena *a, unsigned cls, tcache *owner){
+    slab_run *run = a->slab_empty;
+    if (run){
+        a->slab_empty = run->next;
+        a->slab_empty_count--;
+    } else {
+        if (a->slab_used == RUNS_PER_ARENA){
+            return nullptr;
+        }
+        run = &slab_runs[a->index * RUNS_PER_ARENA + a->slab_used++];
+        a->mapped += RUN_SIZE;
+    }
+    unsigned capacity = (unsigned)(RUN_SIZE / ((cls + 1) * ALIGNMENT));
+    run->owner = owner;
+    run->cls = cls;
+    run->capacity = capacity;
+    run->free_count = capacity;
+    // Every object starts out free
+    for (unsigned i = 0; i < RUN_BITMAP_WORDS; i++){
+        unsigned bits = capacity > i * 64 ? capacity - i * 64 : 0;
+        run->bitmap[i] = bits >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+    }
+    slab_partial_push(a, run);
+    return run;
+}
+
+// Take up to *count objects of class cls, linked through their first word.
+// *count is set to the number actually taken. With an owner they come from
+// that thread's private runs, and new runs become private to it.
+// Called with the arena locked.
+static void *slab_alloc(arena *a, unsigned cls, unsigned *count, tcache *owner){
+    size_t size = (cls + 1) * ALIGNMENT;
+    slab_run **list = slab_partial_list(a, cls, owner);
+    void *result = nullptr;
+    unsigned got = 0;
+    while (got < *count){
+        slab_run *run = *list;
+        // A thread out of private runs first adopts a shared one, such as
+        // those left behind by threads that have exited
+        if (!run && owner && a->slab_partial[cls]){
+            run = a->slab_partial[cls];
+            slab_partial_remove(a, run);
+            run->owner = owner;
+            slab_partial_push(a, run);
+        }
+        if (!run){
+            run = slab_new_run(a, cls, owner);
+            if (!run){
+                break;
+            }
+        }
+        char *memory = run_memory(run);
+        // Take free objects a bitmap word at a time
+        for (unsigned i = 0; i < RUN_BITMAP_WORDS && got < *count; i++){
+            while (run->bitmap[i] && got < *count){
+                unsigned bit = __builtin_ctzll(run->bitmap[i]);
+                // Clear the lowest set bit
+                run->bitmap[i] &= run->bitmap[i] - 1;
+                void *object = memory + (i * 64 + bit) * size;
+                *static_cast<void**>(object) = result;
+                result = object;
+                run->free_count--;
+                got++;
+            }
+        }
+        // A full run leaves the partial list until one of its objects is freed
+        if (!run->free_count){
+            slab_partial_remove(a, run);
+        }
+    }
+    *count = got;
+    return result;
+}
+
+// Give a slab object back to its run
+// Called with the owning arena locked.
+static void slab_free(arena *a, void *ptr){
+    slab_run *run = run_of(ptr);
+    char *memory = run_memory(run);
+    size_t index = (size_t)((char*)ptr - memory) / ((run->cls + 1) * ALIGNMENT);
+    run->bitmap[index / 64] |= (uint64_t)1 << (index % 64);
+    run->free_count++;
+    if (!run->partial){
+        slab_partial_push(a, run);
+    }
+    // A run that is completely free can be reused by any class, but the last
+    // partial run of a class stays so a single object going back and forth
+    // doesn't keep recycling it
+    if (run->free_count == run->capacity && (run->prev || run->next)){
+        slab_partial_remove(a, run);
+        run->owner = nullptr;
+        if (a->slab_empty_count >= SLAB_KEEP_EMPTY){
+            // Enough runs are kept ready, give this one's pages back
+            madvise(memory, RUN_SIZE, MADV_DONTNEED);
+        }
+        run->next = a->slab_empty;
+        a->slab_empty = run;
+        a->slab_empty_count++;
+    }
+}
+
+// Thread caches
+// Each thread keeps a small stack of blocks for every small size class, so
+// most malloc/free calls never touch an arena lock. A cached block still
+// looks allocated to the shared heap or its slab run. Bins hold payload
+// pointers linked through their first word, for heap blocks that is where
+// links(block)->next_free lives. Empty bins are refilled with a batch of
+// blocks under one lock acquisition, and full bins flush half of their blocks back.
+#define TCACHE_DEFAULT_DEPTH 32
+#define TCACHE_MAX_DEPTH 4096
+
+enum tcache_state {
+    TCACHE_UNINITIALISED = 0,
+    TCACHE_ACTIVE,
+    TCACHE_DISABLED // the thread is exiting, or caching is turned off
+};
+
+struct tcache {
+    void *bins[NUM_SMALL_CLASSES]; // singly linked through the first word of each block
+    unsigned counts[NUM_SMALL_CLASSES];
+    tcache_state state;
+    // With MEMALLOC_THREAD_RUNS, the thread's own slab runs that have free
+    // objects. They all come from run_arena, whose lock guards these lists.
+    slab_run *slab_partial[NUM_SLAB_CLASSES];
+    arena *run_arena;
+};
+
+static inline slab_run **slab_partial_list(arena *a, unsigned cls, tcache *owner){
+    return owner ? &owner->slab_partial[cls] : &a->slab_partial[cls];
+}
+
+static __thread tcache thread_cache __attribute__((tls_model("initial-exec")));
+
+// Maximum number of blocks a thread keeps per size class
+static unsigned tcache_depth[NUM_SMALL_CLASSES];
+
+// MEMALLOC_THREAD_RUNS=1 makes the slab runs that fill a thread's cache private
+// to that thread, so objects next to each other never belong to different
+// threads and their cache lines aren't written from two cores. A thread frees
+// other threads' objects back to their runs instead of caching them.
+static bool thread_runs = false;
+// MEMALLOC_ALIGN_CACHELINE=1 rounds blocks of CACHE_LINE bytes or more up to
+// whole cache lines, aligned to them, so no two such blocks share a line
+static bool align_cacheline = false;
+
+// The size a request of size bytes (already aligned) is served with
+static inline size_t cacheline_round(size_t size){
+    if (__builtin_expect(align_cacheline, 0) && size >= CACHE_LINE){
+        size = (size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    }
+    return size;
+}
+
+// A freed heap block of size bytes may go into a cache only if it starts on a
+// cache line, as the caches of those sizes hand out nothing else
+static inline bool cacheable(const void *block, size_t size){
+    return !align_cacheline || size < CACHE_LINE || !((uintptr_t)block & (CACHE_LINE - 1));
+}
+
+// The size whose class a cacheable heap block goes into. A block a little
+// bigger than whole cache lines can only serve as many lines as it holds.
+static inline size_t cacheline_class_size(size_t size){
+    if (__builtin_expect(align_cacheline, 0) && size >= CACHE_LINE){
+        size &= ~(size_t)(CACHE_LINE - 1);
+    }
+    return size;
+}
+
+// Used to drain a thread's cache when it exits
+static pthread_key_t tcache_key;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static bool initialised = false;
+
+// Parse an unsigned number from the environment without allocating
+// Returns the character after the number
+static const char *parse_unsigned(const char *str, unsigned long *value){
+    unsigned long result = 0;
+    while (*str >= '0' && *str <= '9'){
+        result = result * 10 + (*str - '0');
+        str++;
+    }
+    *value = result;
+    return str;
+}
+
+// Settings
+// Every setting is read from its MEMALLOC_<NAME> variable, or else from
+// MEMALLOC_CONF, which holds name=value pairs separated by spaces. Names are
+// those of the variables without the prefix, in any case:
+//   MEMALLOC_CONF="arenas=8 tcache_depth=64,512:8 hugepages=thp"
+// MEMALLOC_CONF is copied into a static buffer once by malloc_init, so
+// reading it doesn't allocate.
+#define CONF_MAX_SETTINGS 32
+
+static char conf_buffer[1024];
+static const char *conf_names[CONF_MAX_SETTINGS];
+static const char *conf_values[CONF_MAX_SETTINGS];
+static unsigned conf_count = 0;
+
+static const char *const conf_known[] = {
+    "ARENAS", "ARENA_POLICY", "NUMA", "TCACHE_DEPTH", "PERCPU_CACHE", "MMAP_THRESHOLD",
+    "PURGE_DECAY_MS", "BACKGROUND_THREAD", "HUGEPAGES", "THREAD_RUNS", "ALIGN_CACHELINE", "STATS", "PROF_SAMPLE",
+    "PROF_SIGNAL", "PROF_PREFIX", "TRACE", "GUARD_SAMPLE", "GUARD_SLOTS", "CHECK_HEADERS"
+};
+
+static bool conf_is_known(const char *name){
+    for (const char *known : conf_known){
+        if (strcasecmp(name, known) == 0){
+            return true;
+        }
+    }
+    return false;
+}
+
+// Split MEMALLOC_CONF into conf_names and conf_values
+static void conf_init(void){
+    const char *env = getenv("MEMALLOC_CONF");
+    if (!env){
+        return;
+    }
+    size_t length = strlen(env);
+    if (length >= sizeof(conf_buffer)){
+        log_print("memalloc: MEMALLOC_CONF is longer than %zu characters, ignored\n", sizeof(conf_buffer) - 1);
+        return;
+    }
+    memcpy(conf_buffer, env, length + 1);
+    char *p = conf_buffer;
+    for (;;){
+        while (*p == ' '){
+            p++;
+        }
+        if (!*p){
+            break;
+        }
+        char *name = p;
+        while (*p && *p != ' '){
+            p++;
+        }
+        if (*p){
+            *p++ = '\0';
+        }
+        char *value = strchr(name, '=');
+        if (!value){
+            log_print("memalloc: MEMALLOC_CONF entry %s has no value\n", name);
+            continue;
+        }
+        *value++ = '\0';
+        if (!conf_is_known(name)){
+            log_print("memalloc: unknown MEMALLOC_CONF setting %s\n", name);
+            continue;
+        }
+        if (conf_count == CONF_MAX_SETTINGS){
+            log_print("memalloc: too many MEMALLOC_CONF settings, %s ignored\n", name);
+            continue;
+        }
+        conf_names[conf_count] = name;
+        conf_values[conf_count] = value;
+        conf_count++;
+    }
+}
+
+// Returns the value of setting name, or nullptr if it isn't set
+// MEMALLOC_<name> wins over MEMALLOC_CONF, and a later entry in MEMALLOC_CONF over an earlier one.
+static const char *config(const char *name){
+    char variable[64];
+    snprintf(variable, sizeof(variable), "MEMALLOC_%s", name);
+    const char *value = getenv(variable);
+    if (value){
+        return value;
+    }
+    for (unsigned i = conf_count; i-- > 0;){
+        if (strcasecmp(conf_names[i], name) == 0){
+            return conf_values[i];
+        }
+    }
+    return nullptr;
+}
+
+// Read a small file such as a sysfs attribute into buf without allocating
+// Returns false if it can't be read.
+static bool read_small_file(const char *path, char *buf, size_t len){
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0){
+        return false;
+    }
+    ssize_t n = read(fd, buf, len - 1);
+    close(fd);
+    if (n <= 0){
+        return false;
+    }
+    buf[n] = 0;
+    return true;
+}
+
+// Take the next range off a kernel list like "0-3,8,10-11"
+// Returns the rest of the list, nullptr at its end.
+static const char *parse_range(const char *list, unsigned long *first, unsigned long *last){
+    if (*list < '0' || *list > '9'){
+        return nullptr;
+    }
+    list = parse_unsigned(list, first);
+    *last = *first;
+    if (*list == '-'){
+        list = parse_unsigned(list + 1, last);
+    }
+    if (*list == ','){
+        list++;
+    }
+    return list;
+}
+
+// Find the memory nodes and their CPUs, and share the arenas out between them
+// MEMALLOC_NUMA=0 treats the machine as a single node.
+static void numa_init(void){
+    node_first_arena[0] = 0;
+    node_arena_count[0] = num_arenas;
+    const char *env = config("NUMA");
+    if (env && strcmp(env, "0") == 0){
+        return;
+    }
+    char list[4096];
+    if (!read_small_file(NODE_SYSFS "/online", list, sizeof(list))){
+        return;
+    }
+    unsigned count = 0;
+    unsigned long first, last;
+    for (const char *p = list; (p = parse_range(p, &first, &last));){
+        for (unsigned long id = first; id <= last && count < MAX_NODES; id++){
+            node_ids[count++] = (unsigned)id;
+        }
+    }
+    if (count < 2){
+        return;
+    }
+    for (unsigned node = 0; node < count; node++){
+        char path[128];
+        snprintf(path, sizeof(path), NODE_SYSFS "/node%u/cpulist", node_ids[node]);
+        if (!read_small_file(path, list, sizeof(list))){
+            continue;
+        }
+        for (const char *p = list; (p = parse_range(p, &first, &last));){
+            for (unsigned long cpu = first; cpu <= last && cpu < MAX_CPUS; cpu++){
+                cpu_nodes[cpu] = (unsigned char)node;
+            }
+        }
+    }
+    num_nodes = count;
+    // Every node needs an arena of its own, nodes get equal shares of the rest
+    if (num_arenas < num_nodes){
+        num_arenas = num_nodes;
+    }
+    for (unsigned node = 0; node < num_nodes; node++){
+        node_first_arena[node] = node * num_arenas / num_nodes;
+        node_arena_count[node] = (node + 1) * num_arenas / num_nodes - node_first_arena[node];
+        for (unsigned i = 0; i < node_arena_count[node]; i++){
+            arenas[node_first_arena[node] + i].node = node;
+        }
+    }
+}
+
+// MEMALLOC_TCACHE_DEPTH is a comma separated list. A plain number sets the
+// depth of every class, "size:depth" sets the depth of the class holding size.
+// e.g. MEMALLOC_TCACHE_DEPTH=64,512:8,1024:0
+static void parse_tcache_depth(const char *str){
+    while (*str){
+        unsigned long first, second;
+        str = parse_unsigned(str, &first);
+        if (*str == ':'){
+            str = parse_unsigned(str + 1, &second);
+            if (first && first <= SMALL_MAX){
+                tcache_depth[size_class(align_size(first))] = second > TCACHE_MAX_DEPTH ? TCACHE_MAX_DEPTH : second;
+            }
+        } else {
+            for (unsigned cls = 0; cls < NUM_SMALL_CLASSES; cls++){
+                tcache_depth[cls] = first > TCACHE_MAX_DEPTH ? TCACHE_MAX_DEPTH : first;
+            }
+        }
+        // Skip to the next entry
+        while (*str && *str != ','){
+            str++;
+        }
+        if (*str == ','){
+            str++;
+        }
+    }
+}
+
+static void tcache_thread_exit(void *arg);
+static void prof_init(void);
+static void percpu_init(void);
+static void trace_init(void);
+static bool background_wanted = false;
+static bool stats_at_exit = false;
+
+// Registry of the counters of running threads
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_stats *stats_threads = nullptr;
+// Counters of threads that have exited
+static thread_stats retired_stats;
+// Used to merge a thread's counters into retired_stats when it exits
+static pthread_key_t stats_key;
+
+static void stats_register(thread_stats *st){
+    pthread_mutex_lock(&stats_lock);
+    st->prev = nullptr;
+    st->next = stats_threads;
+    if (stats_threads){
+        stats_threads->prev = st;
+    }
+    stats_threads = st;
+    st->state = STATS_REGISTERED;
+    pthread_mutex_unlock(&stats_lock);
+    // Registering a value makes pthread call stats_thread_exit when the thread exits
+    pthread_setspecific(stats_key, st);
+}
+
+// Add the counters in st to total
+static void stats_add(thread_stats *total, const thread_stats *st){
+    for (unsigned cls = 0; cls < NUM_CLASSES; cls++){
+        total->allocs[cls] += st->allocs[cls];
+        total->frees[cls] += st->frees[cls];
+    }
+    total->bytes_allocated += st->bytes_allocated;
+    total->bytes_freed += st->bytes_freed;
+    total->lock_contended += st->lock_contended;
+    total->searches += st->searches;
+    total->search_steps += st->search_steps;
+#ifdef MEMALLOC_INSTRUMENT
+    for (unsigned event = 0; event < NUM_LATENCY_EVENTS; event++){
+        for (unsigned bucket = 0; bucket < LATENCY_BUCKETS; bucket++){
+            total->latency[event][bucket] += st->latency[event][bucket];
+        }
+    }
+    for (unsigned steps = 0; steps <= FIT_SEARCH_STEPS; steps++){
+        total->search_lengths[steps] += st->search_lengths[steps];
+    }
+#endif
+}
+
+// Fold an exiting thread's counters into retired_stats
+// Whatever the thread frees after this is no longer counted.
+static void stats_thread_exit(void *arg){
+    thread_stats *st = static_cast<thread_stats*>(arg);
+    pthread_mutex_lock(&stats_lock);
+    stats_add(&retired_stats, st);
+    if (st->prev){
+        st->prev->next = st->next;
+    } else {
+        stats_threads = st->next;
+    }
+    if (st->next){
+        st->next->prev = st->prev;
+    }
+    st->state = STATS_EXITED;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// Guarded allocations
+// With MEMALLOC_GUARD_SAMPLE=N about one allocation in N of up to a page is
+// placed at the end of a page of its own, followed by an inaccessible guard
+// page, like GWP-ASan does. Writing past the end of such a block faults right
+// away. A freed guarded block is made inaccessible too and quarantined: its
+// slot is only reused once every other slot has been, so a use after free is
+// very likely to fault as well. The fault handler reports what went wrong
+// before handing the fault on. Allocations that aren't picked only pay for a
+// thread local decrement, like the profiler's countdown.
+// The pool has MEMALLOC_GUARD_SLOTS slots of two pages each.
+#define GUARD_DEFAULT_SLOTS 256
+
+enum guard_state {
+    GUARD_UNUSED = 0,
+    GUARD_LIVE,
+    GUARD_QUARANTINED
+};
+
+struct guard_slot {
+    void *block;   // the payload handed out from the slot
+    size_t size;
+    unsigned state;
+};
+
+static unsigned long guard_sample = 0;
+static char *guard_pool = nullptr;
+// 0 with guarded allocations off, so no address is ever in the pool
+static size_t guard_pool_size = 0;
+static size_t guard_slot_size = 0;
+static unsigned guard_num_slots = 0;
+static guard_slot *guard_slots = nullptr;
+static unsigned guard_next_unused = 0;
+// Ring of quarantined slots, oldest first
+static unsigned *guard_quarantine = nullptr;
+static unsigned guard_quarantine_head = 0;
+static unsigned guard_quarantine_count = 0;
+// Protects the slots and the quarantine
+static pthread_mutex_t guard_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sigaction guard_old_action;
+
+// Allocations this thread makes before the next guarded one
+static __thread int64_t guard_countdown __attribute__((tls_model("initial-exec")));
+static __thread uint64_t guard_random __attribute__((tls_model("initial-exec")));
+
+static inline bool in_guard_pool(const void *ptr){
+    return (uintptr_t)ptr - (uintptr_t)guard_pool < guard_pool_size;
+}
+
+// Let a fault kill the process the way it would without a handler. A real
+// fault runs again once the handler returns; one sent with kill() doesn't, so
+// it is raised again, and stays blocked until the handler returns.
+static void guard_fault_default(int sig, siginfo_t *info){
+    signal(sig, SIG_DFL);
+    if (info->si_code <= 0){
+        raise(sig);
+    }
+}
+
+// Say what a fault in the pool hit and let it kill the process. Faults
+// anywhere else belong to whoever handled SIGSEGV before memalloc did, so
+// they go to that handler and the guard handler stays installed for the next
+// one; programs that catch their own faults (JITs, GC write barriers) keep
+// getting both. Ignoring a fault doesn't keep the kernel from killing the
+// process, so SIG_IGN is treated like SIG_DFL.
+static void guard_fault(int sig, siginfo_t *info, void *context){
+    if (!in_guard_pool(info->si_addr)){
+        struct sigaction old = guard_old_action;
+        if (old.sa_flags & SA_RESETHAND){
+            // The kernel would have reset it on this delivery
+            guard_old_action.sa_handler = SIG_DFL;
+            guard_old_action.sa_flags &= ~(SA_RESETHAND | SA_SIGINFO);
+        }
+        if (old.sa_flags & SA_SIGINFO){
+            old.sa_sigaction(sig, info, context);
+        } else if (old.sa_handler != SIG_DFL && old.sa_handler != SIG_IGN){
+            old.sa_handler(sig);
+        } else {
+            guard_fault_default(sig, info);
+        }
+        return;
+    }
+    size_t offset = (uintptr_t)info->si_addr - (uintptr_t)guard_pool;
+    guard_slot *slot = &guard_slots[offset / guard_slot_size];
+    if (offset % guard_slot_size >= page_size){
+        log_print("memalloc: heap overflow at %p, past the end of the %zu byte block at %p\n",
+                  info->si_addr, slot->size, slot->block);
+    } else if (slot->state == GUARD_QUARANTINED){
+        log_print("memalloc: use after free at %p, in the freed %zu byte block at %p\n",
+                  info->si_addr, slot->size, slot->block);
+    } else {
+        log_print("memalloc: invalid access at %p in a guarded page\n", info->si_addr);
+    }
+    guard_fault_default(sig, info);
+}
+
+// Read the guard settings and reserve the pool, run from malloc_init
+static void guard_init(void){
+    const char *env = config("GUARD_SAMPLE");
+    if (!env){
+        return;
+    }
+    unsigned long sample;
+    parse_unsigned(env, &sample);
+    if (!sample){
+        return;
+    }
+    unsigned long slots = GUARD_DEFAULT_SLOTS;
+    env = config("GUARD_SLOTS");
+    if (env){
+        parse_unsigned(env, &slots);
+    }
+    if (slots < 1 || slots > UINT32_MAX / 2){
+        slots = GUARD_DEFAULT_SLOTS;
+    }
+    // Nothing in the pool is accessible until it is handed out
+    size_t slot_size = 2 * page_size;
+    void *pool = mmap(nullptr, slots * slot_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pool == MAP_FAILED){
+        return;
+    }
+    void *meta = mmap(nullptr, slots * (sizeof(guard_slot) + sizeof(unsigned)), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (meta == MAP_FAILED){
+        munmap(pool, slots * slot_size);
+        return;
+    }
+    guard_slots = static_cast<guard_slot*>(meta);
+    guard_quarantine = reinterpret_cast<unsigned*>(guard_slots + slots);
+    guard_num_slots = (unsigned)slots;
+    guard_slot_size = slot_size;
+    guard_pool = static_cast<char*>(pool);
+    guard_pool_size = slots * slot_size;
+    guard_sample = sample;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = guard_fault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &guard_old_action);
+}
+
+// Allocations until the next guarded one, uniform with mean guard_sample
+static int64_t guard_next_interval(void){
+    if (!guard_random){
+        guard_random = ((uintptr_t)&guard_random ^ (now_ms() << 32)) | 1;
+    }
+    // xorshift64*
+    guard_random ^= guard_random >> 12;
+    guard_random ^= guard_random << 25;
+    guard_random ^= guard_random >> 27;
+    uint64_t bits = guard_random * 0x2545F4914F6CDD1DULL;
+    return (int64_t)(bits % (2 * guard_sample)) + 1;
+}
+
+// Place a block of size bytes (already aligned) in front of a guard page.
+// Returns nullptr if the allocation should go the normal way instead.
+static __attribute__((noinline)) void *guard_malloc(size_t size){
+    if (!guard_sample){
+        // Guarded allocations are off, make sure this thread never comes back here
+        guard_countdown = INT64_MAX;
+        return nullptr;
+    }
+    // A thread's first allocation only starts its countdown
+    bool first = !guard_random;
+    guard_countdown = guard_next_interval();
+    if (first || size > page_size - sizeof(header_t)){
+        return nullptr;
+    }
+    pthread_mutex_lock(&guard_lock);
+    unsigned index;
+    if (guard_next_unused < guard_num_slots){
+        index = guard_next_unused++;
+    } else if (guard_quarantine_count){
+        index = guard_quarantine[guard_quarantine_head];
+        guard_quarantine_head = (guard_quarantine_head + 1) % guard_num_slots;
+        guard_quarantine_count--;
+    } else {
+        // Every slot is live
+        pthread_mutex_unlock(&guard_lock);
+        return nullptr;
+    }
+    char *page = guard_pool + (size_t)index * guard_slot_size;
+    if (mprotect(page, page_size, PROT_READ | PROT_WRITE) != 0){
+        // Put it back, it is the oldest again
+        guard_quarantine_head = (guard_quarantine_head + guard_num_slots - 1) % guard_num_slots;
+        guard_quarantine[guard_quarantine_head] = index;
+        guard_quarantine_count++;
+        pthread_mutex_unlock(&guard_lock);
+        return nullptr;
+    }
+    // The payload ends where the guard page starts
+    void *block = page + page_size - size;
+    guard_slots[index].block = block;
+    guard_slots[index].size = size;
+    guard_slots[index].state = GUARD_LIVE;
+    pthread_mutex_unlock(&guard_lock);
+
+    header_t *header_ptr = static_cast<header_t*>(block) - 1;
+    header_ptr->s.size = size;
+    header_ptr->s.prev_size = 0;
+    header_ptr->s.is_free = 0;
+    header_ptr->s.arena = 0;
+    // Quarantined pages were given back, so the page is zero either way
+    header_ptr->s.flags = BLOCK_GUARDED | BLOCK_ZEROED;
+    header_ptr->s.sample = 0;
+    header_seal(header_ptr);
+    stat_alloc(size);
+    return block;
+}
+
+// Free a block in the pool and quarantine its slot. The header isn't read,
+// as it is inaccessible after a double free.
+static __attribute__((noinline)) void guard_free(void *block){
+    size_t index = ((uintptr_t)block - (uintptr_t)guard_pool) / guard_slot_size;
+    guard_slot *slot = &guard_slots[index];
+    pthread_mutex_lock(&guard_lock);
+    if (slot->state != GUARD_LIVE || slot->block != block){
+        log_print("memalloc: %s of guarded block %p\n",
+                  slot->state == GUARD_QUARANTINED && slot->block == block ? "double free" : "invalid free", block);
+        abort();
+    }
+    header_verify(static_cast<header_t*>(block) - 1);
+    char *page = guard_pool + index * guard_slot_size;
+    madvise(page, page_size, MADV_DONTNEED);
+    mprotect(page, page_size, PROT_NONE);
+    slot->state = GUARD_QUARANTINED;
+    guard_quarantine[(guard_quarantine_head + guard_quarantine_count) % guard_num_slots] = (unsigned)index;
+    guard_quarantine_count++;
+    pthread_mutex_unlock(&guard_lock);
+    stat_free(slot->size);
+}
+
+// Bootstrap arena
+// Anything malloc_init allocates itself, from inside a libc call it makes,
+// can't wait for malloc_init to finish. The thread running it takes those
+// blocks from a static buffer instead. They are marked BLOCK_BOOTSTRAP and
+// are never counted or reused, free simply forgets them.
+#define BOOTSTRAP_SIZE (64 * 1024)
+
+alignas(ALIGNMENT) static char bootstrap_memory[BOOTSTRAP_SIZE];
+static size_t bootstrap_used = 0;
+// Set on the thread running malloc_init
+static __thread bool bootstrapping __attribute__((tls_model("initial-exec")));
+
+// Allocates size bytes (already aligned) at a multiple of alignment from the bootstrap arena
+// Only the thread running malloc_init gets here, so there is nothing to lock.
+static void *bootstrap_alloc(size_t size, size_t alignment){
+    uintptr_t start = reinterpret_cast<uintptr_t>(bootstrap_memory);
+    uintptr_t payload = (start + bootstrap_used + sizeof(header_t) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (size > BOOTSTRAP_SIZE || payload - start > BOOTSTRAP_SIZE - size){
+        errno = ENOMEM;
+        return nullptr;
+    }
+    bootstrap_used = payload + size - start;
+    header_t *header_ptr = reinterpret_cast<header_t*>(payload) - 1;
+    header_ptr->s.size = size;
+    header_ptr->s.prev_size = 0;
+    header_ptr->s.is_free = 0;
+    header_ptr->s.arena = 0;
+    // The buffer is zero until it is handed out, and nothing is handed out twice
+    header_ptr->s.flags = BLOCK_BOOTSTRAP | BLOCK_ZEROED;
+    header_ptr->s.sample = 0;
+    header_seal(header_ptr);
+    return reinterpret_cast<void*>(payload);
+}
+
+// One time setup, runs on the first allocation
+static void malloc_init(void){
+    bootstrapping = true;
+    conf_init();
+    // MEMALLOC_CHECK_HEADERS=1 checksums every header, before anything is allocated
+    const char *check = config("CHECK_HEADERS");
+    if (check && strcmp(check, "1") == 0){
+        uintptr_t stack = reinterpret_cast<uintptr_t>(&check);
+        header_secret = (stack * 0x9E3779B97F4A7C15ULL) ^ (now_ms() << 20) ^ (uint64_t)getpid();
+        check_headers = true;
+    }
+    // Larger classes cache fewer blocks so a thread holds at most about
+    // TCACHE_DEFAULT_DEPTH * 256 bytes per class
+    for (unsigned cls = 0; cls < NUM_SMALL_CLASSES; cls++){
+        size_t size = (cls + 1) * ALIGNMENT;
+        unsigned depth = TCACHE_DEFAULT_DEPTH;
+        if (size > 256){
+            depth = (unsigned)(TCACHE_DEFAULT_DEPTH * 256 / size);
+        }
+        tcache_depth[cls] = depth < 4 ? 4 : depth;
+    }
+    const char *env = config("TCACHE_DEPTH");
+    if (env){
+        parse_tcache_depth(env);
+    }
+
+    // One arena per CPU this process may run on, unless MEMALLOC_ARENAS says otherwise
+    unsigned long count = 1;
+    cpu_set_t cpus;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0){
+        count = CPU_COUNT(&cpus);
+    }
+    env = config("ARENAS");
+    if (env){
+        parse_unsigned(env, &count);
+    }
+    if (count < 1){
+        count = 1;
+    }
+    num_arenas = count > MAX_ARENAS ? MAX_ARENAS : (unsigned)count;
+    for (unsigned i = 0; i < MAX_ARENAS; i++){
+        pthread_mutex_init(&arenas[i].lock, nullptr);
+        arenas[i].index = i;
+    }
+    // MEMALLOC_ARENA_POLICY=cpu picks the arena by the current CPU instead of round-robin
+    env = config("ARENA_POLICY");
+    if (env && strcmp(env, "cpu") == 0){
+        arena_assignment = ARENA_PER_CPU;
+    }
+    numa_init();
+
+    long page = sysconf(_SC_PAGESIZE);
+    if (page > 0){
+        page_size = (size_t)page;
+    }
+    purge_granule = page_size;
+    // MEMALLOC_HUGEPAGES=thp or hugetlb backs segments with 2MB pages
+    env = config("HUGEPAGES");
+    if (env && strcmp(env, "thp") == 0){
+        hugepages = HUGEPAGES_THP;
+    } else if (env && strcmp(env, "hugetlb") == 0){
+        hugepages = HUGEPAGES_HUGETLB;
+    }
+    if (hugepages != HUGEPAGES_OFF){
+        purge_granule = HUGE_PAGE_SIZE;
+    }
+    // MEMALLOC_MMAP_THRESHOLD sets the size in bytes from which blocks get their own mapping
+    env = config("MMAP_THRESHOLD");
+    if (env){
+        unsigned long threshold;
+        parse_unsigned(env, &threshold);
+        set_mmap_threshold(threshold);
+    }
+    // MEMALLOC_PURGE_DECAY_MS sets how long free spans keep their pages, 0 purges on the next free
+    env = config("PURGE_DECAY_MS");
+    if (env){
+        unsigned long decay;
+        parse_unsigned(env, &decay);
+        purge_decay_ms = decay;
+    }
+    // MEMALLOC_BACKGROUND_THREAD=1 also purges from a thread of our own, so
+    // memory is returned even when the program stops freeing
+    env = config("BACKGROUND_THREAD");
+    if (env && strcmp(env, "1") == 0){
+        background_wanted = true;
+    }
+    env = config("THREAD_RUNS");
+    if (env && strcmp(env, "1") == 0){
+        thread_runs = true;
+    }
+    env = config("ALIGN_CACHELINE");
+    if (env && strcmp(env, "1") == 0){
+        align_cacheline = true;
+    }
+    // MEMALLOC_STATS=1 prints malloc_stats to stderr when the program exits
+    env = config("STATS");
+    if (env && strcmp(env, "1") == 0){
+        stats_at_exit = true;
+    }
+    slab_reserve();
+
+    percpu_init();
+
+    pthread_key_create(&tcache_key, tcache_thread_exit);
+    pthread_key_create(&stats_key, stats_thread_exit);
+    prof_init();
+    guard_init();
+    trace_init();
+    __atomic_store_n(&initialised, true, __ATOMIC_RELEASE);
+    bootstrapping = false;
+}
+
+// Run malloc_init if nobody has yet
+// Returns false on the thread inside malloc_init, which has to allocate from
+// the bootstrap arena. Waiting for itself in pthread_once would never end.
+static inline bool ensure_init(void){
+    if (__builtin_expect(!__atomic_load_n(&initialised, __ATOMIC_ACQUIRE), 0)){
+        if (bootstrapping){
+            return false;
+        }
+        pthread_once(&init_once, malloc_init);
+    }
+    return true;
+}
+
+// Returns the arena the calling thread should allocate from
+static inline arena *get_arena(void){
+    if (arena_assignment == ARENA_PER_CPU){
+        int cpu = sched_getcpu();
+        unsigned node = node_of_cpu(cpu);
+        return &arenas[node_first_arena[node] + (cpu < 0 ? 0 : (unsigned)cpu) % node_arena_count[node]];
+    }
+    arena *a = thread_arena;
+    // A thread the scheduler moved to another node moves to an arena there
+    if (__builtin_expect(!a || (num_nodes > 1 && a->node != current_node()), 0)){
+        ensure_init();
+        unsigned node = current_node();
+        unsigned next = node_next_arena[node].fetch_add(1, std::memory_order_relaxed);
+        a = &arenas[node_first_arena[node] + next % node_arena_count[node]];
+        thread_arena = a;
+    }
+    return a;
+}
+
+// True if a block of arena a must not be cached by the calling thread,
+// because its memory is on another node
+static inline bool node_foreign(arena *a){
+    return num_nodes > 1 && a->node != get_arena()->node;
+}
+
+// The arena that owns a block handed out by malloc
+static inline arena *arena_of(void *block){
+    if (is_slab(block)){
+        return slab_arena(block);
+    }
+    return &arenas[(reinterpret_cast<header_t*>(block) - 1)->s.arena];
+}
+
+// Give a block back to the arena a that owns it
+// Called with the arena locked.
+static inline void arena_free(arena *a, void *block){
+    if (is_slab(block)){
+        slab_free(a, block);
+    } else {
+        heap_free(a, reinterpret_cast<header_t*>(block) - 1);
+    }
+}
+
+// Remote frees
+// A thread freeing blocks of an arena other than its own doesn't take that
+// arena's lock. It pushes them onto the arena's remote free list with a single
+// compare and swap instead, and whoever locks the arena next, usually its
+// owner on its next malloc, frees them in one batch.
+
+// Push the chain first..last, linked through the first word of each block,
+// onto the remote free list of a
+static void remote_free_push(arena *a, void *first, void *last){
+    void *head = a->remote_frees.load(std::memory_order_relaxed);
+    do {
+        *static_cast<void**>(last) = head;
+    } while (!a->remote_frees.compare_exchange_weak(head, first, std::memory_order_release, std::memory_order_relaxed));
+}
+
+// Free everything other threads have queued for a
+// Called with the arena locked.
+static void remote_free_drain(arena *a){
+    // Most of the time there is nothing to do, so check before the exchange
+    if (!a->remote_frees.load(std::memory_order_relaxed)){
+        return;
+    }
+    void *list = a->remote_frees.exchange(nullptr, std::memory_order_acquire);
+    while (list){
+        void *next = *static_cast<void**>(list);
+        arena_free(a, list);
+        list = next;
+    }
+}
+
+// Lock an arena and catch up on the frees other threads queued for it
+static inline void arena_lock(arena *a){
+    if (pthread_mutex_trylock(&a->lock) != 0){
+        thread_counters.lock_contended++;
+        INSTRUMENT_START(start_ns);
+        pthread_mutex_lock(&a->lock);
+        INSTRUMENT_END(LATENCY_LOCK_WAIT, start_ns);
+        MEMALLOC_PROBE(lock_wait, a->index, start_ns);
+    }
+    remote_free_drain(a);
+}
+
+// Return every block in the list to the arena that owns it
+// Blocks are grouped by arena. The calling thread's own arena is locked once
+// for all of its blocks, every other arena gets its group in one remote push.
+static void tcache_release(void *list){
+    arena *home = get_arena();
+    while (list){
+        arena *a = arena_of(list);
+        void *first = nullptr;
+        void *last = nullptr;
+        void *others = nullptr;
+        while (list){
+            void *next = *static_cast<void**>(list);
+            if (arena_of(list) == a){
+                *static_cast<void**>(list) = first;
+                first = list;
+                if (!last){
+                    last = list;
+                }
+            } else {
+                // Owned by another arena, keep it for a later pass
+                *static_cast<void**>(list) = others;
+                others = list;
+            }
+            list = next;
+        }
+        if (a == home){
+            arena_lock(a);
+            while (first){
+                void *next = *static_cast<void**>(first);
+                arena_free(a, first);
+                first = next;
+            }
+            pthread_mutex_unlock(&a->lock);
+        } else {
+            remote_free_push(a, first, last);
+        }
+        list = others;
+    }
+}
+
+// Make the thread's private runs ordinary runs of their arena again, when it
+// exits or has moved to another NUMA node. Full runs aren't on any list, so
+// the arena's runs are searched for the thread's.
+static void slab_disown(tcache *cache){
+    arena *a = cache->run_arena;
+    if (!a){
+        return;
+    }
+    arena_lock(a);
+    slab_run *runs = &slab_runs[(size_t)a->index * RUNS_PER_ARENA];
+    for (size_t i = 0; i < a->slab_used; i++){
+        slab_run *run = &runs[i];
+        if (run->owner != cache){
+            continue;
+        }
+        if (run->partial){
+            slab_partial_remove(a, run);
+        }
+        run->owner = nullptr;
+        if (run->free_count){
+            slab_partial_push(a, run);
+        }
+    }
+    pthread_mutex_unlock(&a->lock);
+    for (unsigned cls = 0; cls < NUM_SLAB_CLASSES; cls++){
+        cache->slab_partial[cls] = nullptr;
+    }
+    cache->run_arena = nullptr;
+}
+
+// Flush every bin, run by pthread when a thread with a cache exits
+static void tcache_thread_exit(void *arg){
+    tcache *cache = static_cast<tcache*>(arg);
+    // Anything freed by later destructors goes straight to the heap
+    cache->state = TCACHE_DISABLED;
+    for (unsigned cls = 0; cls < NUM_SMALL_CLASSES; cls++){
+        if (cache->bins[cls]){
+            tcache_release(cache->bins[cls]);
+        }
+        cache->bins[cls] = nullptr;
+        cache->counts[cls] = 0;
+    }
+    slab_disown(cache);
+}
+
+// Returns the calling thread's cache, or nullptr if it must not be used
+static inline tcache *get_tcache(void){
+    tcache *cache = &thread_cache;
+    if (__builtin_expect(cache->state == TCACHE_ACTIVE, 1)){
+        return cache;
+    }
+    if (cache->state == TCACHE_DISABLED){
+        return nullptr;
+    }
+    ensure_init();
+    // Registering a value makes pthread call tcache_thread_exit when the thread exits
+    cache->state = TCACHE_ACTIVE;
+    pthread_setspecific(tcache_key, cache);
+    return cache;
+}
+
+// Take up to batch blocks of the given (aligned) size from arena a under one
+// lock, linked through their first words with the lowest addresses last.
+// Sets got to how many there are. The blocks mostly end up in caches, which
+// reuse them without the heap seeing it, so none of them is reported as zero.
+static void *arena_alloc_batch(arena *a, size_t size, unsigned batch, unsigned *got_out){
+    arena_lock(a);
+    void *result = nullptr;
+    unsigned got = 0;
+    // The smallest classes come from slab runs
+    if (size <= SLAB_MAX && slab_base){
+        got = batch;
+        result = slab_alloc(a, size_class(size), &got, nullptr);
+    }
+    // Blocks of whole cache lines have to start on one, which carving them
+    // side by side wouldn't give, so they are found one at a time
+    bool aligned = align_cacheline && size >= CACHE_LINE;
+    while (aligned && got < batch){
+        header_t *block = heap_alloc_aligned(a, CACHE_LINE, size);
+        if (!block){
+            break;
+        }
+        block->s.flags &= ~BLOCK_ZEROED;
+        *reinterpret_cast<void**>(block + 1) = result;
+        result = block + 1;
+        got++;
+    }
+    // Take blocks from the free lists, splitting larger ones if needed
+    while (!aligned && got < batch){
+        header_t *block = get_free_block(a, size);
+        if (!block){
+            break;
+        }
+        block->s.is_free = 0;
+        header_seal(block);
+        split_block(a, block, size);
+        *reinterpret_cast<void**>(block + 1) = result;
+        result = block + 1;
+        got++;
+    }
+    // Carve whatever is missing out of the current segment in one go
+    if (!aligned && got < batch){
+        unsigned count = batch - got;
+        header_t *block = heap_grow(a, size, &count);
+        // heap_grow hands back physically contiguous blocks
+        for (unsigned i = 0; block && i < count; i++){
+            block->s.flags &= ~BLOCK_ZEROED;
+            *reinterpret_cast<void**>(block + 1) = result;
+            result = block + 1;
+            got++;
+            block = next_block(block);
+        }
+    }
+    pthread_mutex_unlock(&a->lock);
+    *got_out = got;
+    return result;
+}
+
+// Refill an empty bin with half of its depth worth of blocks from the thread's
+// arena and return one of them
+static void *tcache_refill(tcache *cache, unsigned cls){
+    unsigned got = 0;
+    unsigned batch = tcache_depth[cls] / 2 + 1;
+    void *result = nullptr;
+    // Private runs all come from one arena, which changes only if the thread changes node
+    if (thread_runs && cls < NUM_SLAB_CLASSES && slab_base){
+        if (cache->run_arena && cache->run_arena->node != get_arena()->node){
+            slab_disown(cache);
+        }
+        if (!cache->run_arena){
+            cache->run_arena = get_arena();
+        }
+        arena *a = cache->run_arena;
+        arena_lock(a);
+        got = batch;
+        result = slab_alloc(a, cls, &got, cache);
+        pthread_mutex_unlock(&a->lock);
+    }
+    if (!result){
+        result = arena_alloc_batch(get_arena(), (cls + 1) * ALIGNMENT, batch, &got);
+    }
+    if (!result){
+        return nullptr;
+    }
+    MEMALLOC_PROBE(tcache_refill, cls, got);
+    // Keep all but one block in the cache
+    cache->bins[cls] = *static_cast<void**>(result);
+    cache->counts[cls] += got - 1;
+    return result;
+}
+
+// Give back all but the first keep blocks of a bin that holds more than that
+static void tcache_shrink(tcache *cache, unsigned cls, unsigned keep){
+    void *list = cache->bins[cls];
+    void *last_kept = nullptr;
+    for (unsigned i = 0; i < keep; i++){
+        last_kept = list;
+        list = *static_cast<void**>(list);
+    }
+    if (last_kept){
+        *static_cast<void**>(last_kept) = nullptr;
+    } else {
+        cache->bins[cls] = nullptr;
+    }
+    MEMALLOC_PROBE(tcache_flush, cls, cache->counts[cls] - keep);
+    cache->counts[cls] = keep;
+    tcache_release(list);
+}
+
+// Make room in a full bin by flushing half of it to the heap
+static void tcache_flush(tcache *cache, unsigned cls){
+    tcache_shrink(cache, cls, tcache_depth[cls] / 2);
+}
+
+// Put a freed block into its bin, flushing the bin first if it is full
+static inline void tcache_put(tcache *cache, unsigned cls, void *block){
+    if (cache->counts[cls] >= tcache_depth[cls]){
+        tcache_flush(cache, cls);
+    }
+    *static_cast<void**>(block) = cache->bins[cls];
+    cache->bins[cls] = block;
+    cache->counts[cls]++;
+}
+
+// Per-CPU caches
+// With MEMALLOC_PERCPU_CACHE=1 small blocks are cached per CPU instead of per
+// thread, so the memory held in caches grows with the number of cores and not
+// with the number of threads. Every CPU has a PERCPU_SIZE area: a count per
+// small class, then an array of slots for each class. Taking a block out or
+// putting one in is a restartable sequence (rseq): the kernel restarts it from
+// the top if the thread is preempted, migrated or signalled before the final
+// store of the new count, so a CPU's slots need no locks and no atomics.
+// glibc registers every thread for rseq. Where it hasn't, or the kernel
+// doesn't support it, threads keep using their thread cache.
+#define PERCPU_SHIFT 17
+#define PERCPU_SIZE ((size_t)1 << PERCPU_SHIFT)
+// A CPU is shared by all the threads running on it, so it caches more than one thread would
+#define PERCPU_DEPTH_FACTOR 4
+// The signature glibc registers, which must precede every abort handler
+#define RSEQ_SIGNATURE 0x53053053
+
+static char *percpu_base = nullptr;
+static unsigned percpu_cpus = 0;
+// Where each class's slots start in a CPU's area, and how many there are
+static uintptr_t percpu_offset[NUM_SMALL_CLASSES];
+static unsigned percpu_capacity[NUM_SMALL_CLASSES];
+
+#ifdef HAVE_RSEQ
+static inline struct rseq *rseq_area(void){
+    return reinterpret_cast<struct rseq*>((char*)__builtin_thread_pointer() + __rseq_offset);
+}
+
+// True if the calling thread can use the per-CPU cache for class cls
+// Threads that aren't registered for rseq see a cpu_id that is out of range.
+static inline bool percpu_usable(unsigned cls){
+    return percpu_base && percpu_capacity[cls] && rseq_area()->cpu_id < percpu_cpus;
+}
+
+// Take the last block out of the current CPU's slots for cls, nullptr if there is none
+// The sequence runs from 1 to 2, the store of the new count commits it. The
+// descriptor goes in __rseq_cs and the abort handler after the signature in
+// __rseq_failure, it starts over from 0.
+static inline void *percpu_pop(unsigned cls){
+    struct rseq *rs = rseq_area();
+    uintptr_t area, count;
+    void *block;
+    asm volatile(
+        ".pushsection __rseq_cs, \"aw\"\n"
+        ".balign 32\n"
+        "3:\n"
+        ".long 0, 0\n"
+        ".quad 1f, 2f - 1f, 4f\n"
+        ".popsection\n"
+        "0:\n"
+        "leaq 3b(%%rip), %[area]\n"
+        "movq %[area], %[cs]\n"
+        "1:\n"
+        "movl %[cpu], %k[area]\n"
+        "shlq %[shift], %[area]\n"
+        "addq %[base], %[area]\n"
+        "movl (%[area], %[cls], 4), %k[count]\n"
+        "testl %k[count], %k[count]\n"
+        "jz 5f\n"
+        "leaq (%[area], %[offset]), %[block]\n"
+        "movq -8(%[block], %[count], 8), %[block]\n"
+        "decl %k[count]\n"
+        "movl %k[count], (%[area], %[cls], 4)\n"
+        "2:\n"
+        "jmp 6f\n"
+        ".pushsection __rseq_failure, \"ax\"\n"
+        ".byte 0x0f, 0xb9, 0x3d\n" // a ud1 instruction whose operand is the signature
+        ".long %c[signature]\n"
+        "4:\n"
+        "jmp 0b\n"
+        ".popsection\n"
+        "5:\n"
+        "xorl %k[block], %k[block]\n"
+        "6:\n"
+        : [area] "=&r"(area), [count] "=&r"(count), [block] "=&r"(block), [cs] "=m"(rs->rseq_cs)
+        : [cpu] "m"(rs->cpu_id), [base] "m"(percpu_base), [cls] "r"((uintptr_t)cls),
+          [offset] "r"(percpu_offset[cls]), [shift] "i"(PERCPU_SHIFT), [signature] "i"(RSEQ_SIGNATURE)
+        : "memory", "cc");
+    return block;
+}
+
+// Put a block into the current CPU's slots for cls, false if they are full
+// Writing the slot above the count can't harm anyone if the sequence is
+// restarted, nobody owns that slot until the count has moved past it.
+static inline bool percpu_push(unsigned cls, void *block){
+    struct rseq *rs = rseq_area();
+    uintptr_t area, count, slots;
+    unsigned pushed = 0;
+    asm volatile(
+        ".pushsection __rseq_cs, \"aw\"\n"
+        ".balign 32\n"
+        "3:\n"
+        ".long 0, 0\n"
+        ".quad 1f, 2f - 1f, 4f\n"
+        ".popsection\n"
+        "0:\n"
+        "leaq 3b(%%rip), %[area]\n"
+        "movq %[area], %[cs]\n"
+        "1:\n"
+        "movl %[cpu], %k[area]\n"
+        "shlq %[shift], %[area]\n"
+        "addq %[base], %[area]\n"
+        "movl (%[area], %[cls], 4), %k[count]\n"
+        "cmpl %[capacity], %k[count]\n"
+        "jae 5f\n"
+        "leaq (%[area], %[offset]), %[slots]\n"
+        "movq %[block], (%[slots], %[count], 8)\n"
+        "incl %k[count]\n"
+        "movl %k[count], (%[area], %[cls], 4)\n"
+        "2:\n"
+        "movl $1, %[pushed]\n"
+        ".pushsection __rseq_failure, \"ax\"\n"
+        ".byte 0x0f, 0xb9, 0x3d\n"
+        ".long %c[signature]\n"
+        "4:\n"
+        "jmp 0b\n"
+        ".popsection\n"
+        "5:\n"
+        : [area] "=&r"(area), [count] "=&r"(count), [slots] "=&r"(slots), [cs] "=m"(rs->rseq_cs),
+          [pushed] "+r"(pushed)
+        : [cpu] "m"(rs->cpu_id), [base] "m"(percpu_base), [cls] "r"((uintptr_t)cls),
+          [offset] "r"(percpu_offset[cls]), [capacity] "r"(percpu_capacity[cls]), [block] "r"(block),
+          [shift] "i"(PERCPU_SHIFT), [signature] "i"(RSEQ_SIGNATURE)
+        : "memory", "cc");
+    return pushed;
+}
+#else
+static inline bool percpu_usable(unsigned cls){
+    (void)cls;
+    return false;
+}
+
+static inline void *percpu_pop(unsigned cls){
+    (void)cls;
+    return nullptr;
+}
+
+static inline bool percpu_push(unsigned cls, void *block){
+    (void)cls;
+    (void)block;
+    return false;
+}
+#endif
+
+// Size the per-CPU slots and map the areas, run from malloc_init
+static void percpu_init(void){
+    const char *env = config("PERCPU_CACHE");
+    if (!env || strcmp(env, "1") != 0){
+        return;
+    }
+#ifdef HAVE_RSEQ
+    if (__rseq_size == 0){
+        return;
+    }
+    // CPU numbers go up to the highest possible one, read without allocating
+    char list[256];
+    unsigned long first, last;
+    unsigned cpus = 0;
+    if (read_small_file("/sys/devices/system/cpu/possible", list, sizeof(list))){
+        for (const char *p = list; (p = parse_range(p, &first, &last));){
+            if (last + 1 > cpus){
+                cpus = (unsigned)last + 1;
+            }
+        }
+    }
+    if (!cpus || cpus > MAX_CPUS){
+        return;
+    }
+    // The counts come first, then the slots, halving the depths until they fit
+    size_t slots_start = NUM_SMALL_CLASSES * sizeof(uint32_t);
+    size_t slots_room = (PERCPU_SIZE - slots_start) / sizeof(void*);
+    unsigned factor = PERCPU_DEPTH_FACTOR;
+    size_t total;
+    do {
+        total = 0;
+        for (unsigned cls = 0; cls < NUM_SMALL_CLASSES; cls++){
+            total += (size_t)tcache_depth[cls] * factor;
+        }
+        if (total > slots_room){
+            factor = factor > 1 ? factor / 2 : 0;
+        }
+    } while (total > slots_room && factor);
+    uintptr_t offset = slots_start;
+    for (unsigned cls = 0; cls < NUM_SMALL_CLASSES; cls++){
+        percpu_capacity[cls] = total > slots_room ? 0 : tcache_depth[cls] * factor;
+        percpu_offset[cls] = offset;
+        offset += percpu_capacity[cls] * sizeof(void*);
+    }
+    // Pages are only backed by memory once a CPU uses its area
+    void *memory = mmap(nullptr, (size_t)cpus * PERCPU_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED){
+        return;
+    }
+    percpu_cpus = cpus;
+    percpu_base = static_cast<char*>(memory);
+#endif
+}
+
+// Fill the current CPU's empty slots for cls from the arena and return one block
+// If the slots filled up in the meantime, from another thread on the same CPU
+// or because this one moved, the blocks left over go back to their arena.
+static void *percpu_refill(unsigned cls){
+    unsigned got = 0;
+    void *list = arena_alloc_batch(get_arena(), (cls + 1) * ALIGNMENT, percpu_capacity[cls] / 2 + 1, &got);
+    if (!list){
+        return nullptr;
+    }
+    void *result = list;
+    list = *static_cast<void**>(list);
+    while (list){
+        void *next = *static_cast<void**>(list);
+        if (!percpu_push(cls, list)){
+            break;
+        }
+        list = next;
+    }
+    if (list){
+        tcache_release(list);
+    }
+    return result;
+}
+
+// Put a freed block into the current CPU's slots, first giving half of them
+// back to the arenas if they are full
+static void percpu_free(unsigned cls, void *block){
+    if (percpu_push(cls, block)){
+        return;
+    }
+    void *list = nullptr;
+    for (unsigned i = 0; i < percpu_capacity[cls] / 2; i++){
+        void *old = percpu_pop(cls);
+        if (!old){
+            break;
+        }
+        *static_cast<void**>(old) = list;
+        list = old;
+    }
+    if (!percpu_push(cls, block)){
+        *static_cast<void**>(block) = list;
+        list = block;
+    }
+    tcache_release(list);
+}
+
+// Background purging
+// The purge thread can't be created in malloc_init, pthread_create may itself
+// allocate, so it is started by the first free that reaches an arena.
+static std::atomic<bool> background_started(false);
+
+static void *background_purge(void *arg){
+    (void)arg;
+    // Wake up often enough that no span stays resident much longer than the decay time
+    uint64_t interval = purge_decay_ms / 2;
+    if (interval < 10){
+        interval = 10;
+    }
+    timespec delay;
+    delay.tv_sec = interval / 1000;
+    delay.tv_nsec = (interval % 1000) * 1000000;
+    for (;;){
+        nanosleep(&delay, nullptr);
+        for (unsigned i = 0; i < num_arenas; i++){
+            arena *a = &arenas[i];
+            arena_lock(a);
+            heap_maybe_purge(a);
+            pthread_mutex_unlock(&a->lock);
+        }
+    }
+    return nullptr;
+}
+
+// Start the purge thread if it was asked for and isn't running yet
+// Must be called without any arena lock held.
+static inline void background_start(void){
+    if (__builtin_expect(!background_wanted || background_started.load(std::memory_order_relaxed), 1)){
+        return;
+    }
+    if (background_started.exchange(true)){
+        return;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, background_purge, nullptr) == 0){
+        pthread_detach(thread);
+    }
+}
+
+// Heap profiling
+// With MEMALLOC_PROF_SAMPLE set, one allocation per that many bytes on
+// average is sampled. The gaps between samples are drawn from an exponential
+// distribution, which makes every allocated byte equally likely to be picked.
+// A sampled allocation always gets a header whose sample field points to the
+// record holding its backtrace until it is freed. That field is not in flags,
+// which neighbouring blocks change under the arena lock, so the profiler can
+// set and clear it holding only prof_lock.
+// Live samples are written out in the legacy pprof heap format.
+#define PROF_MAX_DEPTH 32
+#define PROF_MAX_SAMPLES 65536
+
+struct prof_sample {
+    size_t size;           // 0 while the record is unused
+    unsigned depth;
+    unsigned next_free;    // next unused record, while this one is unused
+    void *stack[PROF_MAX_DEPTH];
+};
+
+// Mean bytes between samples, 0 while profiling is off
+static size_t prof_rate = 0;
+static prof_sample *prof_samples = nullptr;
+// Unused records are reused first, PROF_MAX_SAMPLES if there are none
+static unsigned prof_free_head = PROF_MAX_SAMPLES;
+// Records from here on have never been used
+static unsigned prof_next_unused = 0;
+// Protects the records
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *prof_prefix = "memalloc";
+static std::atomic<unsigned> prof_dump_count(0);
+static volatile sig_atomic_t prof_dump_requested = 0;
+
+// Bytes this thread may still allocate before its next sample
+static __thread int64_t prof_countdown __attribute__((tls_model("initial-exec")));
+static __thread uint64_t prof_random __attribute__((tls_model("initial-exec")));
+// Set while the thread is inside the profiler, what it allocates there isn't sampled
+static __thread bool prof_busy __attribute__((tls_model("initial-exec")));
+
+// Dumping from a signal handler isn't safe, so the signal only asks for a
+// dump which the next sampled allocation writes
+static void prof_signal(int sig){
+    (void)sig;
+    prof_dump_requested = 1;
+}
+
+// Read the profiler settings, run from malloc_init
+static void prof_init(void){
+    const char *env = config("PROF_SAMPLE");
+    if (!env){
+        return;
+    }
+    unsigned long rate;
+    parse_unsigned(env, &rate);
+    if (!rate){
+        return;
+    }
+    void *records = mmap(nullptr, PROF_MAX_SAMPLES * sizeof(prof_sample), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (records == MAP_FAILED){
+        return;
+    }
+    prof_samples = static_cast<prof_sample*>(records);
+    prof_rate = rate;
+
+    env = config("PROF_PREFIX");
+    if (env && *env){
+        prof_prefix = env;
+    }
+    env = config("PROF_SIGNAL");
+    if (env){
+        unsigned long sig;
+        parse_unsigned(env, &sig);
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = prof_signal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction((int)sig, &action, nullptr);
+    }
+}
+
+// Bytes until the next sample, exponentially distributed with mean prof_rate
+static int64_t prof_next_interval(void){
+    if (!prof_random){
+        // Seed from the thread's own address and the clock
+        prof_random = ((uintptr_t)&prof_random ^ (now_ms() << 32)) | 1;
+    }
+    // xorshift64*
+    prof_random ^= prof_random >> 12;
+    prof_random ^= prof_random << 25;
+    prof_random ^= prof_random >> 27;
+    uint64_t bits = prof_random * 0x2545F4914F6CDD1DULL;
+    // Uniform in (0, 1]
+    double u = (double)((bits >> 11) + 1) * (1.0 / 9007199254740992.0);
+    double gap = -__builtin_log(u) * (double)prof_rate;
+    return gap >= 9.0e18 ? INT64_MAX : (int64_t)gap + 1;
+}
+
+struct prof_unwind {
+    void **stack;
+    unsigned depth;
+    unsigned skip; // frames inside the allocator
+};
+
+static _Unwind_Reason_Code prof_unwind_frame(struct _Unwind_Context *context, void *arg){
+    prof_unwind *state = static_cast<prof_unwind*>(arg);
+    uintptr_t ip = _Unwind_GetIP(context);
+    if (!ip){
+        return _URC_END_OF_STACK;
+    }
+    if (state->skip){
+        state->skip--;
+        return _URC_NO_REASON;
+    }
+    state->stack[state->depth++] = reinterpret_cast<void*>(ip);
+    return state->depth == PROF_MAX_DEPTH ? _URC_END_OF_STACK : _URC_NO_REASON;
+}
+
+// Give a sampled block a record with its backtrace
+// If every record is in use the block just stays unsampled.
+static void prof_record(header_t *header_ptr, void **stack, unsigned depth){
+    pthread_mutex_lock(&prof_lock);
+    unsigned index = prof_free_head;
+    if (index != PROF_MAX_SAMPLES){
+        prof_free_head = prof_samples[index].next_free;
+    } else if (prof_next_unused < PROF_MAX_SAMPLES){
+        index = prof_next_unused++;
+    }
+    if (index != PROF_MAX_SAMPLES){
+        prof_sample *sample = &prof_samples[index];
+        sample->size = header_ptr->s.size;
+        sample->depth = depth;
+        memcpy(sample->stack, stack, depth * sizeof(void*));
+        header_ptr->s.sample = index + 1;
+    }
+    pthread_mutex_unlock(&prof_lock);
+}
+
+// A sampled block is being freed, release its record
+static void prof_forget(header_t *header_ptr){
+    pthread_mutex_lock(&prof_lock);
+    unsigned index = header_ptr->s.sample - 1;
+    prof_sample *sample = &prof_samples[index];
+    sample->size = 0;
+    sample->next_free = prof_free_head;
+    prof_free_head = index;
+    pthread_mutex_unlock(&prof_lock);
+    header_ptr->s.sample = 0;
+}
+
+// A sampled block changed size in place
+static void prof_resize(header_t *header_ptr){
+    pthread_mutex_lock(&prof_lock);
+    prof_samples[header_ptr->s.sample - 1].size = header_ptr->s.size;
+    pthread_mutex_unlock(&prof_lock);
+}
+
+// Buffered output to a file descriptor that never allocates
+struct prof_writer {
+    int fd;
+    size_t used;
+    bool failed;
+    char buf[4096];
+};
+
+static void prof_flush(prof_writer *w){
+    size_t done = 0;
+    while (done < w->used && !w->failed){
+        ssize_t n = write(w->fd, w->buf + done, w->used - done);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n <= 0){
+            w->failed = true;
+            break;
+        }
+        done += (size_t)n;
+    }
+    w->used = 0;
+}
+
+// Append to the writer, every call must produce less than 256 bytes
+static void prof_printf(prof_writer *w, const char *fmt, ...){
+    if (sizeof(w->buf) - w->used < 256){
+        prof_flush(w);
+    }
+    va_list args;
+    va_start(args, fmt);
+    int length = vsnprintf(w->buf + w->used, sizeof(w->buf) - w->used, fmt, args);
+    va_end(args);
+    if (length > 0){
+        w->used += (size_t)length < 256 ? (size_t)length : 255;
+    }
+}
+
+// Write every live sample to path in the legacy pprof heap format.
+// The heap_v2 tag tells pprof the sampling rate so it can scale the samples
+// back up to an estimate of the whole heap.
+static int prof_dump(const char *path){
+    if (!prof_rate){
+        errno = EINVAL;
+        return -1;
+    }
+    char name[4096];
+    if (!path){
+        snprintf(name, sizeof(name), "%s.%d.%u.heap", prof_prefix, (int)getpid(),
+                 prof_dump_count.fetch_add(1, std::memory_order_relaxed));
+        path = name;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0){
+        return -1;
+    }
+    prof_writer w;
+    w.fd = fd;
+    w.used = 0;
+    w.failed = false;
+
+    pthread_mutex_lock(&prof_lock);
+    size_t objects = 0;
+    size_t bytes = 0;
+    for (unsigned i = 0; i < prof_next_unused; i++){
+        if (prof_samples[i].size){
+            objects++;
+            bytes += prof_samples[i].size;
+        }
+    }
+    prof_printf(&w, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", objects, bytes, objects, bytes, prof_rate);
+    for (unsigned i = 0; i < prof_next_unused; i++){
+        prof_sample *sample = &prof_samples[i];
+        if (!sample->size){
+            continue;
+        }
+        prof_printf(&w, "1: %zu [1: %zu] @", sample->size, sample->size);
+        for (unsigned frame = 0; frame < sample->depth; frame++){
+            prof_printf(&w, " %p", sample->stack[frame]);
+        }
+        prof_printf(&w, "\n");
+    }
+    pthread_mutex_unlock(&prof_lock);
+
+    // pprof needs the memory map to turn addresses into symbols
+    prof_printf(&w, "\nMAPPED_LIBRARIES:\n");
+    prof_flush(&w);
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps >= 0){
+        ssize_t n;
+        while ((n = read(maps, w.buf, sizeof(w.buf))) > 0){
+            w.used = (size_t)n;
+            prof_flush(&w);
+        }
+        close(maps);
+    }
+    close(fd);
+    if (w.failed){
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+// Take a sample: an allocation with a header and a backtrace.
+// Returns nullptr if the allocation should go the normal way instead.
+// Never inlined, so exactly this frame and malloc's are skipped in backtraces.
+static __attribute__((noinline)) void *prof_malloc(size_t size){
+    if (!prof_rate){
+        // Profiling is off, make sure this thread never comes back here
+        prof_countdown = INT64_MAX;
+        return nullptr;
+    }
+    prof_countdown = prof_next_interval();
+    // The unwinder may allocate the first time it runs
+    if (prof_busy){
+        return nullptr;
+    }
+    prof_busy = true;
+    void *stack[PROF_MAX_DEPTH];
+    prof_unwind state = { stack, 0, 2 };
+    _Unwind_Backtrace(prof_unwind_frame, &state);
+
+    header_t *header_ptr;
+    if (size >= mmap_threshold || size > HEAP_MAX){
+        header_ptr = mmap_alloc(size, ALIGNMENT);
+    } else {
+        arena *a = get_arena();
+        arena_lock(a);
+        header_ptr = heap_alloc(a, size);
+        pthread_mutex_unlock(&a->lock);
+    }
+    if (header_ptr){
+        stat_alloc(header_ptr->s.size);
+        prof_record(header_ptr, stack, state.depth);
+    }
+    if (prof_dump_requested){
+        prof_dump_requested = 0;
+        prof_dump(nullptr);
+    }
+    prof_busy = false;
+    return header_ptr ? reinterpret_cast<void*>(header_ptr + 1) : nullptr;
+}
+
+// Tracing
+// With MEMALLOC_TRACE=<prefix> every call is recorded into a buffer of the
+// calling thread. Full buffers are queued for a writer thread that appends
+// them to <prefix>.<pid> as chunks, so the calls themselves never wait on the
+// disk. The file format is described in memalloc.h. Buffers are mapped
+// directly from the OS, tracing never allocates through the allocator.
+#define TRACE_EVENTS 8192
+
+struct trace_buffer {
+    trace_buffer *next;   // the full or spare list while queued, all buffers in use otherwise
+    trace_buffer *prev;
+    memalloc_trace_chunk chunk;
+    memalloc_trace_event events[TRACE_EVENTS];
+};
+
+static bool tracing = false;
+static int trace_fd = -1;
+static uint64_t trace_start_ns;
+// Protects the buffer lists below
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_ready = PTHREAD_COND_INITIALIZER;
+// Held while a chunk is being written, so chunks never interleave
+static pthread_mutex_t trace_write_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_buffer *trace_active = nullptr;   // buffers owned by running threads
+static trace_buffer *trace_full = nullptr;     // waiting for the writer, oldest last
+static trace_buffer *trace_spare = nullptr;    // written out, ready for reuse
+static bool trace_writer_started = false;
+// Set while the writer has a buffer off the lists, trace_idle is signalled when it's done
+static bool trace_writer_busy = false;
+static pthread_cond_t trace_idle = PTHREAD_COND_INITIALIZER;
+static std::atomic<unsigned> trace_next_thread(0);
+static pthread_key_t trace_key;
+
+static __thread trace_buffer *trace_current __attribute__((tls_model("initial-exec")));
+// Set once the thread has exited its buffer, later calls from it aren't recorded
+static __thread bool trace_done __attribute__((tls_model("initial-exec")));
+
+static void trace_thread_exit(void *arg);
+
+// Open the trace file, run from malloc_init
+// The pid goes in the name like for heap profiles, so processes started from
+// a traced one (shell wrappers and the like) don't write over each other.
+static void trace_init(void){
+    const char *prefix = config("TRACE");
+    if (!prefix || !*prefix){
+        return;
+    }
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.%d", prefix, (int)getpid());
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd < 0){
+        return;
+    }
+    memalloc_trace_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MEMALLOC_TRACE_MAGIC, sizeof(header.magic));
+    header.event_size = sizeof(memalloc_trace_event);
+    if (write(trace_fd, &header, sizeof(header)) != (ssize_t)sizeof(header)){
+        close(trace_fd);
+        trace_fd = -1;
+        return;
+    }
+    pthread_key_create(&trace_key, trace_thread_exit);
+    trace_start_ns = now_ns();
+    tracing = true;
+}
+
+// Write one buffer to the file as a chunk
+static void trace_write(trace_buffer *buffer){
+    pthread_mutex_lock(&trace_write_lock);
+    const char *data = reinterpret_cast<const char*>(&buffer->chunk);
+    size_t length = sizeof(buffer->chunk) + buffer->chunk.count * sizeof(memalloc_trace_event);
+    while (length){
+        ssize_t n = write(trace_fd, data, length);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n <= 0){
+            break;
+        }
+        data += n;
+        length -= (size_t)n;
+    }
+    pthread_mutex_unlock(&trace_write_lock);
+}
+
+// Take the oldest full buffer off the queue, nullptr if there is none
+// Must be called with trace_lock held.
+static trace_buffer *trace_take_full(void){
+    trace_buffer **link = &trace_full;
+    if (!*link){
+        return nullptr;
+    }
+    while ((*link)->next){
+        link = &(*link)->next;
+    }
+    trace_buffer *buffer = *link;
+    *link = nullptr;
+    return buffer;
+}
+
+static void *trace_writer(void *arg){
+    (void)arg;
+    pthread_mutex_lock(&trace_lock);
+    for (;;){
+        trace_buffer *buffer = trace_take_full();
+        if (!buffer){
+            pthread_cond_wait(&trace_ready, &trace_lock);
+            continue;
+        }
+        trace_writer_busy = true;
+        pthread_mutex_unlock(&trace_lock);
+        trace_write(buffer);
+        pthread_mutex_lock(&trace_lock);
+        trace_writer_busy = false;
+        pthread_cond_broadcast(&trace_idle);
+        buffer->next = trace_spare;
+        trace_spare = buffer;
+    }
+    return nullptr;
+}
+
+// Unlink a buffer from the list of buffers in use
+// Must be called with trace_lock held.
+static void trace_unlink_active(trace_buffer *buffer){
+    if (buffer->prev){
+        buffer->prev->next = buffer->next;
+    } else {
+        trace_active = buffer->next;
+    }
+    if (buffer->next){
+        buffer->next->prev = buffer->prev;
+    }
+}
+
+// A forked child starts out with copies of the parent's buffers, whose events
+// the parent writes itself. The child isn't traced.
+static void trace_fork_child(void){
+    tracing = false;
+    trace_current = nullptr;
+    trace_done = true;
+}
+
+// Queue the thread's buffer for writing and give it an empty one
+// Returns false if no buffer could be had.
+static bool trace_swap(void){
+    trace_buffer *old_buffer = trace_current;
+    bool start_writer = false;
+    pthread_mutex_lock(&trace_lock);
+    if (old_buffer){
+        trace_unlink_active(old_buffer);
+        old_buffer->next = trace_full;
+        trace_full = old_buffer;
+        pthread_cond_signal(&trace_ready);
+        if (!trace_writer_started){
+            trace_writer_started = true;
+            start_writer = true;
+        }
+    }
+    trace_buffer *buffer = trace_spare;
+    if (buffer){
+        trace_spare = buffer->next;
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    if (!buffer){
+        void *memory = mmap(nullptr, sizeof(trace_buffer), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED){
+            trace_current = nullptr;
+            return false;
+        }
+        buffer = static_cast<trace_buffer*>(memory);
+    }
+    buffer->chunk.thread = old_buffer ? old_buffer->chunk.thread : trace_next_thread.fetch_add(1);
+    buffer->chunk.count = 0;
+    pthread_mutex_lock(&trace_lock);
+    buffer->prev = nullptr;
+    buffer->next = trace_active;
+    if (trace_active){
+        trace_active->prev = buffer;
+    }
+    trace_active = buffer;
+    pthread_mutex_unlock(&trace_lock);
+    if (!old_buffer){
+        // Registering a value makes pthread call trace_thread_exit when the thread exits
+        pthread_setspecific(trace_key, buffer);
+    }
+    trace_current = buffer;
+
+    // pthread_create may allocate, so it waits until nothing is locked
+    if (start_writer){
+        pthread_t thread;
+        if (pthread_create(&thread, nullptr, trace_writer, nullptr) == 0){
+            pthread_detach(thread);
+        }
+    }
+    return true;
+}
+
+// Record one call
+static void trace_record(unsigned op, size_t size, void *ptr, void *old_ptr){
+    if (trace_done){
+        return;
+    }
+    trace_buffer *buffer = trace_current;
+    if (!buffer || buffer->chunk.count == TRACE_EVENTS){
+        if (!trace_swap()){
+            return;
+        }
+        buffer = trace_current;
+    }
+    memalloc_trace_event *event = &buffer->events[buffer->chunk.count];
+    event->time = now_ns() - trace_start_ns;
+    event->op_size = ((uint64_t)op << 56) | (size & (((uint64_t)1 << 56) - 1));
+    event->ptr = (uintptr_t)ptr;
+    event->old_ptr = (uintptr_t)old_ptr;
+    buffer->chunk.count++;
+}
+
+// Queue an exiting thread's last buffer
+// The key only holds the thread's first buffer, the current one is in trace_current.
+static void trace_thread_exit(void *arg){
+    (void)arg;
+    trace_buffer *buffer = trace_current;
+    trace_done = true;
+    trace_current = nullptr;
+    if (!buffer){
+        return;
+    }
+    pthread_mutex_lock(&trace_lock);
+    trace_unlink_active(buffer);
+    buffer->next = trace_full;
+    trace_full = buffer;
+    pthread_cond_signal(&trace_ready);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// At exit write out everything still queued and the buffers of threads that
+// are still running, the writer thread may already be gone
+static void __attribute__((destructor)) trace_finish(void){
+    if (!tracing){
+        return;
+    }
+    tracing = false;
+    pthread_mutex_lock(&trace_lock);
+    // Let the writer finish the chunk it is on
+    while (trace_writer_busy){
+        pthread_cond_wait(&trace_idle, &trace_lock);
+    }
+    while (trace_buffer *buffer = trace_take_full()){
+        trace_write(buffer);
+    }
+    for (trace_buffer *buffer = trace_active; buffer; buffer = buffer->next){
+        trace_write(buffer);
+        // The chunk is written, drop it if its thread records anything else
+        buffer->chunk.count = 0;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Fork
+// The child of fork has only the thread that called it, so a lock another
+// thread held at that moment would stay locked in the child forever. Every
+// lock the allocator may need is taken before fork, arenas first since the
+// others are taken inside them if at all. Afterwards the parent releases
+// them and the child sets them up afresh, along with the state of threads
+// it doesn't have.
+static void fork_prepare(void){
+    for (unsigned i = 0; i < num_arenas; i++){
+        pthread_mutex_lock(&arenas[i].lock);
+    }
+    pthread_mutex_lock(&stats_lock);
+    pthread_mutex_lock(&prof_lock);
+    pthread_mutex_lock(&guard_lock);
+}
+
+static void fork_parent(void){
+    pthread_mutex_unlock(&guard_lock);
+    pthread_mutex_unlock(&prof_lock);
+    pthread_mutex_unlock(&stats_lock);
+    for (unsigned i = num_arenas; i-- > 0;){
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+}
+
+static void fork_child(void){
+    pthread_mutex_init(&guard_lock, nullptr);
+    pthread_mutex_init(&prof_lock, nullptr);
+    pthread_mutex_init(&stats_lock, nullptr);
+    for (unsigned i = 0; i < num_arenas; i++){
+        pthread_mutex_init(&arenas[i].lock, nullptr);
+    }
+    // The other threads are gone, their counters stay as if they had exited
+    for (thread_stats *st = stats_threads; st; st = st->next){
+        if (st != &thread_counters){
+            stats_add(&retired_stats, st);
+        }
+    }
+    stats_threads = nullptr;
+    if (thread_counters.state == STATS_REGISTERED){
+        thread_counters.prev = nullptr;
+        thread_counters.next = nullptr;
+        stats_threads = &thread_counters;
+    }
+    // The purge thread wasn't copied either, the child starts its own
+    background_started.store(false, std::memory_order_relaxed);
+    trace_fork_child();
+}
+
+// pthread_atfork allocates, so it can't be called from malloc_init.
+// This runs when the library is loaded, before the program forks.
+static void __attribute__((constructor)) fork_handlers_init(void){
+    ensure_init();
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+// Statistics reporting
+
+// With MEMALLOC_STATS=1 the statistics are printed as the program exits
+static void __attribute__((destructor)) stats_exit_report(void){
+    if (stats_at_exit){
+        malloc_stats();
+    }
+}
+
+// Counters of all threads added up, plus what the arenas hold right now
+struct stats_summary {
+    thread_stats counters;
+    unsigned threads;
+    size_t heap_mapped;  // segments and slab runs
+    size_t free_blocks;  // blocks on free lists and free slab objects
+    size_t free_bytes;
+    size_t mmap_bytes;
+    size_t mmap_count;
+};
+
+// Largest size that falls in a size class
+static size_t class_max(unsigned cls){
+    if (cls < NUM_SMALL_CLASSES){
+        return (size_t)(cls + 1) * ALIGNMENT;
+    }
+    unsigned lg = SMALL_MAX_LOG2 + (cls - NUM_SMALL_CLASSES) / CLASS_STEPS;
+    unsigned step = (cls - NUM_SMALL_CLASSES) % CLASS_STEPS;
+    if (lg >= 63){
+        return SIZE_MAX;
+    }
+    return ((size_t)1 << lg) + (size_t)(step + 1) * ((size_t)1 << (lg - CLASS_STEPS_LOG2));
+}
+
+// Look at what one arena holds, under its lock
+static void arena_summary(arena *a, size_t *mapped, size_t *free_blocks, size_t *free_bytes){
+    size_t blocks = 0;
+    size_t bytes = 0;
+    arena_lock(a);
+    for (int cls = next_nonempty_class(a, 0); cls >= 0; cls = next_nonempty_class(a, cls + 1)){
+        for (header_t *block = a->free_lists[cls]; block; block = links(block)->next_free){
+            blocks++;
+            bytes += block->s.size;
+        }
+    }
+    for (unsigned cls = 0; cls < NUM_SLAB_CLASSES; cls++){
+        for (slab_run *run = a->slab_partial[cls]; run; run = run->next){
+            blocks += run->free_count;
+            bytes += (size_t)run->free_count * (cls + 1) * ALIGNMENT;
+        }
+    }
+    // Private runs are on their threads' lists, so they are found from the runs themselves
+    if (thread_runs){
+        slab_run *runs = &slab_runs[(size_t)a->index * RUNS_PER_ARENA];
+        for (size_t i = 0; i < a->slab_used; i++){
+            if (runs[i].owner){
+                blocks += runs[i].free_count;
+                bytes += (size_t)runs[i].free_count * (runs[i].cls + 1) * ALIGNMENT;
+            }
+        }
+    }
+    bytes += (size_t)a->slab_empty_count * RUN_SIZE;
+    *mapped = a->mapped;
+    pthread_mutex_unlock(&a->lock);
+    *free_blocks = blocks;
+    *free_bytes = bytes;
+}
+
+// Merge the counters of every thread and look at every arena
+// The counters of running threads are read while they keep changing, so the
+// result is a snapshot rather than an exact total.
+static void stats_collect(stats_summary *sum){
+    ensure_init();
+    memset(sum, 0, sizeof(*sum));
+    pthread_mutex_lock(&stats_lock);
+    stats_add(&sum->counters, &retired_stats);
+    for (thread_stats *st = stats_threads; st; st = st->next){
+        stats_add(&sum->counters, st);
+        sum->threads++;
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    for (unsigned i = 0; i < num_arenas; i++){
+        size_t mapped, blocks, bytes;
+        arena_summary(&arenas[i], &mapped, &blocks, &bytes);
+        sum->heap_mapped += mapped;
+        sum->free_blocks += blocks;
+        sum->free_bytes += bytes;
+    }
+    sum->mmap_bytes = mmap_bytes.load(std::memory_order_relaxed);
+    sum->mmap_count = mmap_count.load(std::memory_order_relaxed);
+}
+
+// Bytes handed out and not freed yet
+static inline size_t stats_in_use(const stats_summary *sum){
+    const thread_stats *c = &sum->counters;
+    return c->bytes_allocated > c->bytes_freed ? c->bytes_allocated - c->bytes_freed : 0;
+}
+
+// A buffer that keeps counting once it is full, like snprintf
+struct json_buffer {
+    char *buf;
+    size_t len;
+    size_t used;
+};
+
+static void json_append(json_buffer *out, const char *fmt, ...){
+    va_list args;
+    va_start(args, fmt);
+    char *dest = out->used < out->len ? out->buf + out->used : nullptr;
+    size_t room = out->used < out->len ? out->len - out->used : 0;
+    int length = vsnprintf(dest, room, fmt, args);
+    va_end(args);
+    if (length > 0){
+        out->used += (size_t)length;
+    }
+}
+
+static void *aligned_allocate(size_t alignment, size_t size);
+
+// Allocates size bytes of memory and returns a pointer to the allocated memory.
+static inline __attribute__((always_inline)) void *allocate(size_t size){
+    // if the requested size is 0, return NULL
+    if (!size){
+        return nullptr;
+    }
+    // Guard against the rounding below wrapping around
+    if (size > SIZE_MAX / 2){
+        return nullptr;
+    }
+    size = align_size(size);
+    if (__builtin_expect(!ensure_init(), 0)){
+        return bootstrap_alloc(size, ALIGNMENT);
+    }
+
+    // Until the next sample is due the profiler costs one thread local subtraction
+    if (__builtin_expect((prof_countdown -= (int64_t)size) < 0, 0)){
+        void *block = prof_malloc(size);
+        if (block){
+            return block;
+        }
+    }
+    // Guarded allocations are counted down the same way
+    if (__builtin_expect(--guard_countdown < 0, 0)){
+        void *block = guard_malloc(size);
+        if (block){
+            return block;
+        }
+    }
+
+    // Slab objects of whole cache lines are aligned to them already, as runs
+    // are, and the caches are refilled with aligned heap blocks. Only what
+    // would come from the heap directly has to ask for the alignment.
+    size = cacheline_round(size);
+    if (__builtin_expect(align_cacheline, 0) && size > SMALL_MAX){
+        return aligned_allocate(CACHE_LINE, size);
+    }
+
+    // Large sizes get a mapping of their own
+    if (size >= mmap_threshold || size > HEAP_MAX){
+        header_t *header_ptr = mmap_alloc(size, ALIGNMENT);
+        if (!header_ptr){
+            return nullptr;
+        }
+        stat_alloc(header_ptr->s.size);
+        return reinterpret_cast<void*>(header_ptr + 1);
+    }
+
+    // Small sizes are served from the CPU's or the thread's cache without locking
+    if (size <= SMALL_MAX){
+        unsigned cls = size_class(size);
+        if (percpu_usable(cls)){
+            void *block = percpu_pop(cls);
+            if (!block){
+                block = percpu_refill(cls);
+                if (!block){
+                    return nullptr;
+                }
+            }
+            stat_alloc(is_slab(block) ? size : (reinterpret_cast<header_t*>(block) - 1)->s.size);
+            return block;
+        }
+        tcache *cache = get_tcache();
+        if (cache && tcache_depth[cls]){
+            void *block = cache->bins[cls];
+            if (block){
+                cache->bins[cls] = *static_cast<void**>(block);
+                cache->counts[cls]--;
+            } else {
+                block = tcache_refill(cache, cls);
+                if (!block){
+                    return nullptr;
+                }
+            }
+            // A heap block in the bin can be a little bigger than the class
+            stat_alloc(is_slab(block) ? size : (reinterpret_cast<header_t*>(block) - 1)->s.size);
+            return block;
+        }
+    }
+
+    // Without a thread cache the smallest sizes still come from a slab run
+    if (size <= SLAB_MAX && slab_base){
+        arena *a = get_arena();
+        unsigned count = 1;
+        arena_lock(a);
+        void *block = slab_alloc(a, size_class(size), &count, nullptr);
+        pthread_mutex_unlock(&a->lock);
+        if (block){
+            stat_alloc(size);
+            return block;
+        }
+    }
+
+    if (__builtin_expect(align_cacheline, 0) && size >= CACHE_LINE){
+        return aligned_allocate(CACHE_LINE, size);
+    }
+
+    // Lock the mutex of this thread's arena
+    arena *a = get_arena();
+    arena_lock(a);
+    header_t* header_ptr = heap_alloc(a, size);
+    // Unlock the mutex
+    pthread_mutex_unlock(&a->lock);
+    if (!header_ptr){
+        return nullptr;
+    }
+    stat_alloc(header_ptr->s.size);
+
+    // Want to hide the header from the user
+    // Incrementing the pointer by 1 will give the user the memory block
+    // Adding one moves the pointer by the size of one header_t as header_ptr is a pointer to header_t
+    return reinterpret_cast<void*>(header_ptr + 1);
+}
+
+// Fill out with up to n blocks of size bytes, for memalloc_alloc_batch
+// Everything below the mmap threshold comes from the thread's arena under one
+// lock. Free blocks are used first, then slab runs and the segment are carved,
+// so whatever is new is contiguous. out is filled in address order.
+// Sizes are rounded to cache lines like allocate does.
+// Returns how many blocks were allocated.
+static size_t allocate_batch(size_t size, void **out, size_t n){
+    if (!size || !n || size > SIZE_MAX / 2){
+        return 0;
+    }
+    size = cacheline_round(align_size(size));
+    bool ready = ensure_init();
+    size_t filled = 0;
+    // A batch that reaches the next profiler sample has its first block sampled
+    if (prof_rate && (prof_countdown -= (int64_t)(size * n)) < 0){
+        prof_countdown = 0;
+        out[filled] = allocate(size);
+        if (!out[filled]){
+            return 0;
+        }
+        filled++;
+    }
+    if (ready && size < mmap_threshold && size <= HEAP_MAX){
+        arena *a = get_arena();
+        while (filled < n){
+            unsigned want = n - filled > UINT32_MAX ? UINT32_MAX : (unsigned)(n - filled);
+            unsigned got = 0;
+            void *list = arena_alloc_batch(a, size, want, &got);
+            if (!got){
+                break;
+            }
+            // The lowest address comes last in the chain
+            for (size_t i = filled + got; i-- > filled;){
+                out[i] = list;
+                list = *static_cast<void**>(list);
+            }
+            for (size_t i = filled; i < filled + got; i++){
+                stat_alloc(is_slab(out[i]) ? size : (reinterpret_cast<header_t*>(out[i]) - 1)->s.size);
+            }
+            filled += got;
+        }
+    }
+    // Mapped blocks, and whatever the arena couldn't give, one at a time
+    for (; filled < n; filled++){
+        out[filled] = allocate(size);
+        if (!out[filled]){
+            break;
+        }
+    }
+    return filled;
+}
+
+// Frees memory block
+// Free a slab object of class cls
+static inline void release_slab(void *block, unsigned cls){
+    stat_free((cls + 1) * ALIGNMENT);
+    arena *a = slab_arena(block);
+    if (percpu_usable(cls) && !node_foreign(a)){
+        percpu_free(cls, block);
+        return;
+    }
+    tcache *cache = get_tcache();
+    if (cache && tcache_depth[cls] && !node_foreign(a) && (!thread_runs || run_of(block)->owner == cache)){
+        tcache_put(cache, cls, block);
+        return;
+    }
+    if (a != get_arena()){
+        remote_free_push(a, block, block);
+        return;
+    }
+    arena_lock(a);
+    slab_free(a, block);
+    pthread_mutex_unlock(&a->lock);
+}
+
+static inline void release(void *block){
+    if (!block){
+        return;
+    }
+
+    // Slab objects have no header, their run is found from the address
+    if (is_slab(block)){
+        release_slab(block, run_of(block)->cls);
+        return;
+    }
+
+    // Guarded blocks are told apart by their address too
+    if (__builtin_expect(in_guard_pool(block), 0)){
+        guard_free(block);
+        return;
+    }
+
+    // Get the pointer to the header of the block
+    header_t* header_ptr = reinterpret_cast<header_t*>(block) - 1;
+
+    if (__builtin_expect(header_ptr->s.flags & BLOCK_BOOTSTRAP, 0)){
+        return;
+    }
+    if (__builtin_expect(check_headers, 0)){
+        header_verify_release(header_ptr);
+    }
+    stat_free(header_ptr->s.size);
+    if (header_ptr->s.sample){
+        prof_forget(header_ptr);
+    }
+
+    // Mapped blocks go straight back to the OS
+    if (header_ptr->s.flags & BLOCK_MMAPPED){
+        mmap_free(header_ptr);
+        return;
+    }
+    // Small blocks go back to the thread cache without locking
+    // flags is only written under the arena lock, as the neighbours' frees
+    // change BLOCK_LAST in it. Blocks in the caches never have BLOCK_ZEROED,
+    // so one that still has it goes to heap_free to have it cleared there.
+    arena *a = &arenas[header_ptr->s.arena];
+    if (header_ptr->s.size <= SMALL_MAX && !(header_ptr->s.flags & BLOCK_ZEROED) &&
+        cacheable(block, header_ptr->s.size)){
+        unsigned cls = size_class(cacheline_class_size(header_ptr->s.size));
+        if (percpu_usable(cls) && !node_foreign(a)){
+            percpu_free(cls, block);
+            return;
+        }
+        tcache *cache = get_tcache();
+        if (cache && tcache_depth[cls] && !node_foreign(a)){
+            tcache_put(cache, cls, block);
+            return;
+        }
+    }
+
+    // Blocks of another thread's arena are queued for it instead of taking its lock
+    if (a != get_arena()){
+        remote_free_push(a, block, block);
+        return;
+    }
+    // lock the mutex of the arena that owns the block
+    arena_lock(a);
+    heap_free(a, header_ptr);
+    // unlock the mutex
+    pthread_mutex_unlock(&a->lock);
+    background_start();
+}
+
+// Free a block whose size the caller knows, for free_sized and sized delete
+// A slab object is recognised by its address alone and its class follows
+// from the size, so the run's metadata isn't read at all. Every other block
+// has a header right in front of it that has to be looked at anyway.
+static inline void release_sized(void *block, size_t size){
+    if (is_slab(block) && size && size <= SLAB_MAX){
+        release_slab(block, size_class(cacheline_round(align_size(size))));
+        return;
+    }
+    release(block);
+}
+
+// Free n blocks at once, for memalloc_free_batch
+// The blocks skip the caches. Those of the thread's own arena are freed in
+// array order under a single lock, the blocks of every other arena are
+// chained up and handed over in one push. Walking the array and not a chain
+// through the blocks keeps the loads independent, so cold blocks don't cost
+// a cache miss each one after the other.
+static void release_batch(void **blocks, size_t n){
+    arena *home = get_arena();
+    void *first[MAX_ARENAS] = {};
+    void *last[MAX_ARENAS] = {};
+    bool locked = false;
+    for (size_t i = 0; i < n; i++){
+        void *block = blocks[i];
+        if (!block){
+            continue;
+        }
+        if (is_slab(block)){
+            stat_free(slab_size(block));
+        } else {
+            if (in_guard_pool(block)){
+                guard_free(block);
+                continue;
+            }
+            header_t *header_ptr = reinterpret_cast<header_t*>(block) - 1;
+            if (header_ptr->s.flags & BLOCK_BOOTSTRAP){
+                continue;
+            }
+            if (check_headers){
+                header_verify_release(header_ptr);
+            }
+            stat_free(header_ptr->s.size);
+            // The rare mapped and sampled blocks are freed without holding the arena
+            if (header_ptr->s.sample || (header_ptr->s.flags & BLOCK_MMAPPED)){
+                if (locked){
+                    pthread_mutex_unlock(&home->lock);
+                    locked = false;
+                }
+                if (header_ptr->s.sample){
+                    prof_forget(header_ptr);
+                }
+                if (header_ptr->s.flags & BLOCK_MMAPPED){
+                    mmap_free(header_ptr);
+                    continue;
+                }
+            }
+            // heap_free clears BLOCK_ZEROED, under the lock that guards flags
+        }
+        arena *a = arena_of(block);
+        if (a == home){
+            if (!locked){
+                arena_lock(home);
+                locked = true;
+            }
+            arena_free(home, block);
+            continue;
+        }
+        *static_cast<void**>(block) = first[a->index];
+        first[a->index] = block;
+        if (!last[a->index]){
+            last[a->index] = block;
+        }
+    }
+    if (locked){
+        pthread_mutex_unlock(&home->lock);
+    }
+    for (unsigned i = 0; i < num_arenas; i++){
+        if (first[i]){
+            remote_free_push(&arenas[i], first[i], last[i]);
+        }
+    }
+    background_start();
+}
+
+// Allocates memory for an array of num elements of nsize bytes each and returns a pointer to the allocated memory
+static void *zero_allocate(size_t num, size_t nsize){
+    if (!num || !nsize){
+        return nullptr;
+    }
+
+    size_t size = num * nsize;
+
+    // Check for overflow
+    if (nsize != size / num){
+        return NULL;
+    }
+
+    void *block = allocate(size);
+    if (!block){
+        return nullptr;
+    }
+
+    // Memory fresh from the OS is already zero, apart from the link a
+    // thread cache may have stored in its first word
+    if (!is_slab(block)){
+        header_t *header_ptr = reinterpret_cast<header_t*>((uintptr_t)block - sizeof(header_t));
+        if (header_ptr->s.flags & BLOCK_ZEROED){
+            *static_cast<void**>(block) = nullptr;
+            return block;
+        }
+    }
+
+    // set the memory block to zero
+    if (size >= STREAMING_CLEAR_MIN){
+        clear_large(block, align_size(size));
+    } else {
+        memset(block, 0, size);
+    }
+    return block;
+
+}
+
+// Change the size of the given memory block to the size given
+static void *reallocate(void *block, size_t size){
+    if (!block || !size){
+        // if block is null, allocate a new one
+        // if size is 0, allocate will handle it
+        return allocate(size);
+    }
+
+    // Slab objects stay where they are as long as the new size is in their class.
+    // One that shrinks to a smaller class moves, so free_sized with the new
+    // size always finds the right class.
+    if (is_slab(block)){
+        size_t old_size = slab_size(block);
+        if (size <= SLAB_MAX && size_class(cacheline_round(align_size(size))) == size_class(old_size)){
+            return block;
+        }
+        void *new_block = allocate(size);
+        if (new_block){
+            memcpy(new_block, block, size < old_size ? size : old_size);
+            release(block);
+        }
+        return new_block;
+    }
+
+    // Get the header of the block
+    header_t *header_ptr = reinterpret_cast<header_t*>(block) - 1;
+    if (__builtin_expect(check_headers, 0)){
+        header_verify_release(header_ptr);
+    }
+
+    // A mapped block that stays above the threshold is resized by mremap,
+    // which moves page table entries instead of copying the data
+    if ((header_ptr->s.flags & BLOCK_MMAPPED) && size >= mmap_threshold){
+        size_t old_size = header_ptr->s.size;
+        header_t *resized = mmap_resize(header_ptr, size);
+        if (resized){
+            stat_resize(old_size, resized->s.size);
+            if (resized->s.sample){
+                prof_resize(resized);
+            }
+            return reinterpret_cast<void*>(resized + 1);
+        }
+    }
+
+    // Resize arena blocks in place where possible. Growing past the mmap
+    // threshold moves the block to a mapping so later growth can use mremap.
+    if (!(header_ptr->s.flags & (BLOCK_MMAPPED | BLOCK_BOOTSTRAP | BLOCK_GUARDED)) && size <= SIZE_MAX / 2){
+        size_t new_size = cacheline_round(align_size(size));
+        if (new_size <= header_ptr->s.size || new_size < mmap_threshold){
+            arena *a = &arenas[header_ptr->s.arena];
+            size_t old_size = header_ptr->s.size;
+            arena_lock(a);
+            bool resized = heap_resize(a, header_ptr, new_size);
+            size_t resized_size = header_ptr->s.size;
+            pthread_mutex_unlock(&a->lock);
+            if (resized){
+                stat_resize(old_size, resized_size);
+                if (header_ptr->s.sample){
+                    prof_resize(header_ptr);
+                }
+                return block;
+            }
+        }
+    }
+
+    // A mapped block that still fits and stays above the threshold keeps its mapping
+    // (mapped blocks shrinking below the threshold move back into an arena)
+    if ((header_ptr->s.flags & BLOCK_MMAPPED) && header_ptr->s.size >= size && size >= mmap_threshold){
+        return block;
+    }
+
+    // Allocate a new block of correct size
+    void *new_block = allocate(size);
+    if (new_block){
+        // copy the contents of the old block to the new block
+        memcpy(new_block, block, header_ptr->s.size < size ? header_ptr->s.size : size);
+        // free the old block
+        release(block);
+    }
+    return new_block;
+}
+
+// Allocates size bytes whose address is a multiple of alignment (a power of two)
+static void *aligned_allocate(size_t alignment, size_t size){
+    if (alignment <= ALIGNMENT){
+        return allocate(size);
+    }
+    // Like glibc, round an alignment that isn't a power of two up to one
+    if (alignment & (alignment - 1)){
+        if (alignment > SIZE_MAX / 2){
+            errno = EINVAL;
+            return nullptr;
+        }
+        alignment = (size_t)1 << (64 - __builtin_clzl(alignment));
+    }
+    if (!size){
+        return nullptr;
+    }
+    if (size > SIZE_MAX / 4 || alignment > SIZE_MAX / 4){
+        errno = ENOMEM;
+        return nullptr;
+    }
+    size = align_size(size);
+    if (!ensure_init()){
+        return bootstrap_alloc(size, alignment);
+    }
+
+    header_t *header_ptr;
+    if (size >= mmap_threshold || size + alignment > HEAP_MAX){
+        header_ptr = mmap_alloc(size, alignment);
+    } else {
+        arena *a = get_arena();
+        arena_lock(a);
+        header_ptr = heap_alloc_aligned(a, alignment, size);
+        pthread_mutex_unlock(&a->lock);
+    }
+    if (!header_ptr){
+        errno = ENOMEM;
+        return nullptr;
+    }
+    stat_alloc(header_ptr->s.size);
+    return reinterpret_cast<void*>(header_ptr + 1);
+}
+
+// Regions
+// A region hands out memory by bumping a pointer through chunks it takes from
+// the heap, and blocks are never freed on their own: reset gives everything
+// back at once and destroy gives back the region too. Chunks start small and
+// double in size, so a reset region keeps only its latest chunk and soon has
+// one that fits a whole request. Regions have no lock, each one belongs to a
+// single thread at a time.
+#define REGION_CHUNK_MIN (64 * 1024)
+#define REGION_CHUNK_MAX (1024 * 1024)
+
+struct region_chunk {
+    region_chunk *next;
+    size_t size;            // usable bytes after this header
+};
+
+struct memalloc_region {
+    char *bump;             // next free byte in the current chunk
+    char *end;
+    region_chunk *current;  // the chunk being bumped through
+    region_chunk *chunks;   // all the other chunks
+    size_t next_size;       // size of the next chunk
+};
+
+static inline char *region_chunk_start(region_chunk *chunk){
+    return reinterpret_cast<char*>(chunk + 1);
+}
+
+static memalloc_region *region_create(void){
+    memalloc_region *region = static_cast<memalloc_region*>(allocate(sizeof(memalloc_region)));
+    if (!region){
+        return nullptr;
+    }
+    region->bump = nullptr;
+    region->end = nullptr;
+    region->current = nullptr;
+    region->chunks = nullptr;
+    region->next_size = REGION_CHUNK_MIN;
+    return region;
+}
+
+// Rounds p up to a multiple of alignment (a power of two)
+static inline char *align_pointer(char *p, size_t alignment){
+    return reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(p) + alignment - 1) & ~(uintptr_t)(alignment - 1));
+}
+
+// Called when the current chunk can't fit size bytes at alignment
+static void *region_alloc_slow(memalloc_region *region, size_t size, size_t alignment){
+    size_t need = size + alignment - ALIGNMENT;
+    // A block too large for the chunks gets one of its own, so it doesn't
+    // waste what is left of the current chunk
+    bool own_chunk = need > region->next_size / 4;
+    size_t chunk_size = own_chunk ? need : region->next_size;
+    region_chunk *chunk = static_cast<region_chunk*>(allocate(sizeof(region_chunk) + chunk_size));
+    if (!chunk){
+        return nullptr;
+    }
+    chunk->size = chunk_size;
+    char *block = align_pointer(region_chunk_start(chunk), alignment);
+    if (own_chunk){
+        chunk->next = region->chunks;
+        region->chunks = chunk;
+        return block;
+    }
+    if (region->current){
+        region->current->next = region->chunks;
+        region->chunks = region->current;
+    }
+    chunk->next = nullptr;
+    region->current = chunk;
+    region->bump = block + size;
+    region->end = region_chunk_start(chunk) + chunk_size;
+    if (region->next_size < REGION_CHUNK_MAX){
+        region->next_size *= 2;
+    }
+    return block;
+}
+
+// Allocates size bytes from region at a multiple of alignment (a power of two, at least ALIGNMENT)
+static inline void *region_alloc(memalloc_region *region, size_t size, size_t alignment){
+    if (!size){
+        return nullptr;
+    }
+    if (size > SIZE_MAX / 4 || alignment > SIZE_MAX / 4){
+        errno = ENOMEM;
+        return nullptr;
+    }
+    size = align_size(size);
+    if (region->bump){
+        char *block = align_pointer(region->bump, alignment);
+        if (block <= region->end && size <= (size_t)(region->end - block)){
+            region->bump = block + size;
+            return block;
+        }
+    }
+    return region_alloc_slow(region, size, alignment);
+}
+
+// Frees every chunk but the current one, which starts over
+static void region_reset(memalloc_region *region){
+    region_chunk *chunk = region->chunks;
+    while (chunk){
+        region_chunk *next = chunk->next;
+        release(chunk);
+        chunk = next;
+    }
+    region->chunks = nullptr;
+    if (region->current){
+        region->bump = region_chunk_start(region->current);
+    }
+}
+
+static void region_destroy(memalloc_region *region){
+    region_reset(region);
+    release(region->current);
+    release(region);
+}
+
+extern "C" {
+
+    // Allocates size bytes of memory and returns a pointer to the allocated memory.
+    void* malloc(size_t size){
+        DEBUG_PRINT("malloc: requesting %zu bytes\n", size);
+        void *block = allocate(size);
+        if (__builtin_expect(tracing, 0)){
+            trace_record(TRACE_MALLOC, size, block, nullptr);
+        }
+        return block;
+    }
+
+    // Frees memory block
+    void free(void *block){
+        DEBUG_PRINT("free: freeing block %p\n", block);
+        if (__builtin_expect(tracing, 0) && block){
+            trace_record(TRACE_FREE, 0, block, nullptr);
+        }
+        release(block);
+    }
+
+    // C23: frees a block of size bytes from malloc, calloc or realloc
+    void free_sized(void *block, size_t size){
+        DEBUG_PRINT("free_sized: freeing block %p of %zu bytes\n", block, size);
+        if (__builtin_expect(tracing, 0) && block){
+            trace_record(TRACE_FREE, 0, block, nullptr);
+        }
+        release_sized(block, size);
+    }
+
+    // C23: frees a block of size bytes from aligned_alloc
+    // Over-aligned blocks never live in slab runs, so the alignment isn't needed.
+    void free_aligned_sized(void *block, size_t alignment, size_t size){
+        DEBUG_PRINT("free_aligned_sized: freeing block %p of %zu bytes\n", block, size);
+        (void)alignment;
+        if (__builtin_expect(tracing, 0) && block){
+            trace_record(TRACE_FREE, 0, block, nullptr);
+        }
+        release_sized(block, size);
+    }
+
+    // Allocates n blocks of size bytes, taking the arena's lock once
+    size_t memalloc_alloc_batch(size_t size, void **out, size_t n){
+        DEBUG_PRINT("memalloc_alloc_batch: requesting %zu blocks of %zu bytes\n", n, size);
+        size_t filled = allocate_batch(size, out, n);
+        if (__builtin_expect(tracing, 0)){
+            for (size_t i = 0; i < filled; i++){
+                trace_record(TRACE_MALLOC, size, out[i], nullptr);
+            }
+        }
+        return filled;
+    }
+
+    // Creates an empty region, see memalloc.h
+    memalloc_region *memalloc_region_create(void){
+        DEBUG_PRINT("memalloc_region_create\n");
+        return region_create();
+    }
+
+    // Allocates size bytes from region, freed only with the whole region
+    void *memalloc_region_alloc(memalloc_region *region, size_t size){
+        DEBUG_PRINT("memalloc_region_alloc: requesting %zu bytes from %p\n", size, (void*)region);
+        return region_alloc(region, size, ALIGNMENT);
+    }
+
+    // Allocates size bytes from region at a multiple of alignment (a power of two)
+    void *memalloc_region_memalign(memalloc_region *region, size_t alignment, size_t size){
+        DEBUG_PRINT("memalloc_region_memalign: requesting %zu bytes aligned to %zu from %p\n", size, alignment, (void*)region);
+        if (!alignment || (alignment & (alignment - 1))){
+            errno = EINVAL;
+            return nullptr;
+        }
+        return region_alloc(region, size, alignment < ALIGNMENT ? ALIGNMENT : alignment);
+    }
+
+    // Frees everything allocated from region, which stays usable
+    void memalloc_region_reset(memalloc_region *region){
+        DEBUG_PRINT("memalloc_region_reset: %p\n", (void*)region);
+        region_reset(region);
+    }
+
+    // Frees everything allocated from region and the region itself
+    void memalloc_region_destroy(memalloc_region *region){
+        DEBUG_PRINT("memalloc_region_destroy: %p\n", (void*)region);
+        if (region){
+            region_destroy(region);
+        }
+    }
+
+    // Frees n blocks, taking each arena's lock at most once
+    void memalloc_free_batch(void **ptrs, size_t n){
+        DEBUG_PRINT("memalloc_free_batch: freeing %zu blocks\n", n);
+        if (__builtin_expect(tracing, 0)){
+            for (size_t i = 0; i < n; i++){
+                if (ptrs[i]){
+                    trace_record(TRACE_FREE, 0, ptrs[i], nullptr);
+                }
+            }
+        }
+        release_batch(ptrs, n);
+    }
+
+    // Changes a setting while the program runs, returns 1 if it did and 0 otherwise
+    // Only M_MMAP_THRESHOLD and the M_MEMALLOC_* parameters of memalloc.h are
+    // supported, everything else is fixed once the allocator has started.
+    int mallopt(int param, int value){
+        DEBUG_PRINT("mallopt: setting %d to %d\n", param, value);
+        ensure_init();
+        if (value < 0){
+            return 0;
+        }
+        switch (param){
+        case M_MMAP_THRESHOLD:
+            set_mmap_threshold((size_t)value);
+            return 1;
+        case M_MEMALLOC_TCACHE_DEPTH: {
+            // The per-CPU caches are laid out for the depth they started with
+            if (percpu_base){
+                return 0;
+            }
+            unsigned depth = value > TCACHE_MAX_DEPTH ? TCACHE_MAX_DEPTH : (unsigned)value;
+            for (unsigned cls = 0; cls < NUM_SMALL_CLASSES; cls++){
+                tcache_depth[cls] = depth;
+            }
+            // The calling thread gives back what its bins hold beyond that now.
+            // Other threads do when a bin next fills up, or when they exit.
+            tcache *cache = &thread_cache;
+            if (cache->state == TCACHE_ACTIVE){
+                for (unsigned cls = 0; cls < NUM_SMALL_CLASSES; cls++){
+                    if (cache->counts[cls] > depth){
+                        tcache_shrink(cache, cls, depth);
+                    }
+                }
+            }
+            return 1;
+        }
+        case M_MEMALLOC_PURGE_DECAY_MS:
+            purge_decay_ms = (uint64_t)value;
+            return 1;
+        }
+        return 0;
+    }
+
+    // Allocates memory for an array of num elements of nsize bytes each and returns a pointer to the allocated memory
+    void* calloc(size_t num, size_t nsize){
+        DEBUG_PRINT("calloc: requesting %zu bytes\n", num * nsize);
+        void *block = zero_allocate(num, nsize);
+        if (__builtin_expect(tracing, 0)){
+            trace_record(TRACE_CALLOC, num * nsize, block, nullptr);
+        }
+        return block;
+    }
+
+    // Change the size of the given memory block to the size given
+    void* realloc(void *block, size_t size){
+        DEBUG_PRINT("realloc: requesting %zu bytes\n", size);
+        void *new_block = reallocate(block, size);
+        if (__builtin_expect(tracing, 0)){
+            trace_record(TRACE_REALLOC, size, new_block, block);
+        }
+        return new_block;
+    }
+
+    // Allocates size bytes whose address is a multiple of alignment (a power of two)
+    void* memalign(size_t alignment, size_t size){
+        DEBUG_PRINT("memalign: requesting %zu bytes aligned to %zu\n", size, alignment);
+        void *block = aligned_allocate(alignment, size);
+        if (__builtin_expect(tracing, 0)){
+            trace_record(TRACE_MEMALIGN, size, block, reinterpret_cast<void*>(alignment));
+        }
+        return block;
+    }
+
+    int posix_memalign(void **memptr, size_t alignment, size_t size){
+        // The alignment must be a power of two and a multiple of sizeof(void*)
+        if (!alignment || (alignment & (alignment - 1)) || (alignment % sizeof(void*))){
+            return EINVAL;
+        }
+        if (!size){
+            *memptr = nullptr;
+            return 0;
+        }
+        int saved_errno = errno;
+        void *block = memalign(alignment, size);
+        if (!block){
+            errno = saved_errno;
+            return ENOMEM;
+        }
+        *memptr = block;
+        return 0;
+    }
+
+    // C11 aligned allocation, the alignment must be a power of two
+    void* aligned_alloc(size_t alignment, size_t size){
+        if (!alignment || (alignment & (alignment - 1))){
+            errno = EINVAL;
+            return nullptr;
+        }
+        return memalign(alignment, size);
+    }
+
+    // Allocates size bytes aligned to the page size
+    void* valloc(size_t size){
+        ensure_init();
+        return memalign(page_size, size);
+    }
+
+    // Like valloc, but also rounds the size up to whole pages
+    void* pvalloc(size_t size){
+        ensure_init();
+        if (size > SIZE_MAX / 2){
+            errno = ENOMEM;
+            return nullptr;
+        }
+        return memalign(page_size, page_round(size ? size : 1));
+    }
+
+    // Returns how many bytes can actually be used at block, which may be more than was requested
+    size_t malloc_usable_size(void *block){
+        if (!block){
+            return 0;
+        }
+        if (is_slab(block)){
+            return slab_size(block);
+        }
+        header_t *header_ptr = reinterpret_cast<header_t*>(block) - 1;
+        return header_ptr->s.size;
+    }
+
+    // Print a summary of every arena and the totals to stderr, like glibc's malloc_stats
+    void malloc_stats(void){
+        ensure_init();
+        for (unsigned i = 0; i < num_arenas; i++){
+            size_t mapped, blocks, bytes;
+            arena_summary(&arenas[i], &mapped, &blocks, &bytes);
+            if (num_nodes > 1){
+                log_print("Arena %u (node %u):\n", i, node_ids[arenas[i].node]);
+            } else {
+                log_print("Arena %u:\n", i);
+            }
+            log_print("system bytes     = %10zu\n", mapped);
+            log_print("free bytes       = %10zu\n", bytes);
+        }
+        stats_summary sum;
+        stats_collect(&sum);
+        log_print("Total (incl. mmap):\n");
+        log_print("system bytes     = %10zu\n", sum.heap_mapped + sum.mmap_bytes);
+        log_print("in use bytes     = %10zu\n", stats_in_use(&sum));
+        log_print("mmap regions     = %10zu\n", sum.mmap_count);
+        log_print("mmap bytes       = %10zu\n", sum.mmap_bytes);
+        log_print("lock contention  = %10llu\n", (unsigned long long)sum.counters.lock_contended);
+#ifdef MEMALLOC_INSTRUMENT
+        // Only the buckets that have seen anything, by their upper bound
+        for (unsigned event = 0; event < NUM_LATENCY_EVENTS; event++){
+            for (unsigned bucket = 0; bucket < LATENCY_BUCKETS; bucket++){
+                if (sum.counters.latency[event][bucket]){
+                    log_print("%-9s <= %11lluns %10llu\n", latency_names[event],
+                              (unsigned long long)(1ULL << bucket),
+                              (unsigned long long)sum.counters.latency[event][bucket]);
+                }
+            }
+        }
+        for (unsigned steps = 0; steps <= FIT_SEARCH_STEPS; steps++){
+            if (sum.counters.search_lengths[steps]){
+                log_print("search of %2u     = %10llu\n", steps,
+                          (unsigned long long)sum.counters.search_lengths[steps]);
+            }
+        }
+#endif
+    }
+
+    // glibc's summary of the heap, filled in from the allocator's own counters
+    struct mallinfo2 mallinfo2(void){
+        stats_summary sum;
+        stats_collect(&sum);
+        struct mallinfo2 info;
+        memset(&info, 0, sizeof(info));
+        info.arena = sum.heap_mapped;     // memory taken from the OS for the arenas
+        info.ordblks = sum.free_blocks;
+        info.hblks = sum.mmap_count;      // blocks with a mapping of their own
+        info.hblkhd = sum.mmap_bytes;
+        info.uordblks = stats_in_use(&sum);
+        info.fordblks = sum.free_bytes;
+        return info;
+    }
+
+    int memalloc_prof_dump(const char *path){
+        ensure_init();
+        return prof_dump(path);
+    }
+
+    size_t memalloc_stats_json(char *buf, size_t len){
+        stats_summary sum;
+        stats_collect(&sum);
+        const thread_stats *c = &sum.counters;
+        json_buffer out = { buf, len, 0 };
+        json_append(&out, "{\"threads\":%u,\"arenas\":%u,\"nodes\":%u", sum.threads, num_arenas, num_nodes);
+        json_append(&out, ",\"bytes_allocated\":%llu,\"bytes_freed\":%llu,\"bytes_in_use\":%zu",
+                    (unsigned long long)c->bytes_allocated, (unsigned long long)c->bytes_freed, stats_in_use(&sum));
+        json_append(&out, ",\"heap_mapped\":%zu,\"mmap_bytes\":%zu,\"mmap_count\":%zu",
+                    sum.heap_mapped, sum.mmap_bytes, sum.mmap_count);
+        json_append(&out, ",\"free_blocks\":%zu,\"free_bytes\":%zu", sum.free_blocks, sum.free_bytes);
+        json_append(&out, ",\"lock_contended\":%llu,\"searches\":%llu,\"search_steps\":%llu",
+                    (unsigned long long)c->lock_contended, (unsigned long long)c->searches,
+                    (unsigned long long)c->search_steps);
+        // Only classes that have seen any traffic
+        json_append(&out, ",\"classes\":[");
+        bool first = true;
+        for (unsigned cls = 0; cls < NUM_CLASSES; cls++){
+            if (!c->allocs[cls] && !c->frees[cls]){
+                continue;
+            }
+            json_append(&out, "%s{\"size\":%zu,\"allocs\":%llu,\"frees\":%llu}", first ? "" : ",",
+                        class_max(cls), (unsigned long long)c->allocs[cls], (unsigned long long)c->frees[cls]);
+            first = false;
+        }
+        json_append(&out, "]");
+#ifdef MEMALLOC_INSTRUMENT
+        // Whole histograms, bucket b counts times of at most 2^b ns
+        json_append(&out, ",\"latency\":{");
+        for (unsigned event = 0; event < NUM_LATENCY_EVENTS; event++){
+            json_append(&out, "%s\"%s\":[", event ? "," : "", latency_names[event]);
+            for (unsigned bucket = 0; bucket < LATENCY_BUCKETS; bucket++){
+                json_append(&out, "%s%llu", bucket ? "," : "", (unsigned long long)c->latency[event][bucket]);
+            }
+            json_append(&out, "]");
+        }
+        json_append(&out, "},\"search_lengths\":[");
+        for (unsigned steps = 0; steps <= FIT_SEARCH_STEPS; steps++){
+            json_append(&out, "%s%llu", steps ? "," : "", (unsigned long long)c->search_lengths[steps]);
+        }
+        json_append(&out, "]");
+#endif
+        json_append(&out, "}");
+        return out.used;
+    }
+}
+
+// C++ new and delete
+// Defining every form here saves the trip through libstdc++'s operator new
+// into malloc. allocate inlines into each one, and only a failed allocation
+// leaves the fast path for the new-handler loop. C++14 and later pass the
+// size of what is deleted, which is the size new asked for, so the sized
+// deletes can free like free_sized does. The sized and aligned forms are
+// only defined where the compiler has them, so older standards still build.
+
+// The standard's loop for a failed new: call the new-handler until memory
+// turns up, or throw std::bad_alloc if there is none
+static __attribute__((noinline)) void *new_failed(size_t size, size_t alignment){
+    // new of 0 bytes still returns a unique pointer
+    if (!size){
+        size = 1;
+    }
+    for (;;){
+        void *block = alignment ? aligned_allocate(alignment, size) : allocate(size);
+        if (block){
+            return block;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (!handler){
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+// The nothrow forms return a null pointer where the others would throw
+static __attribute__((noinline)) void *new_failed_nothrow(size_t size, size_t alignment) noexcept{
+    try {
+        return new_failed(size, alignment);
+    } catch (...){
+        return nullptr;
+    }
+}
+
+static inline __attribute__((always_inline)) void *new_block(size_t size){
+    void *block = allocate(size);
+    if (__builtin_expect(!block, 0)){
+        block = new_failed(size, 0);
+    }
+    if (__builtin_expect(tracing, 0)){
+        trace_record(TRACE_MALLOC, size, block, nullptr);
+    }
+    return block;
+}
+
+static inline __attribute__((always_inline)) void *new_block_nothrow(size_t size) noexcept{
+    void *block = allocate(size);
+    if (__builtin_expect(!block, 0)){
+        block = new_failed_nothrow(size, 0);
+    }
+    if (__builtin_expect(tracing, 0)){
+        trace_record(TRACE_MALLOC, size, block, nullptr);
+    }
+    return block;
+}
+
+#ifdef __cpp_aligned_new
+static void *new_aligned(size_t size, size_t alignment){
+    void *block = aligned_allocate(alignment, size);
+    if (!block){
+        block = new_failed(size, alignment);
+    }
+    if (__builtin_expect(tracing, 0)){
+        trace_record(TRACE_MEMALIGN, size, block, reinterpret_cast<void*>(alignment));
+    }
+    return block;
+}
+
+static void *new_aligned_nothrow(size_t size, size_t alignment) noexcept{
+    void *block = aligned_allocate(alignment, size);
+    if (!block){
+        block = new_failed_nothrow(size, alignment);
+    }
+    if (__builtin_expect(tracing, 0)){
+        trace_record(TRACE_MEMALIGN, size, block, reinterpret_cast<void*>(alignment));
+    }
+    return block;
+}
+#endif
+
+static inline __attribute__((always_inline)) void delete_block(void *block){
+    if (__builtin_expect(tracing, 0) && block){
+        trace_record(TRACE_FREE, 0, block, nullptr);
+    }
+    release(block);
+}
+
+#ifdef __cpp_sized_deallocation
+static inline __attribute__((always_inline)) void delete_sized(void *block, size_t size){
+    if (__builtin_expect(tracing, 0) && block){
+        trace_record(TRACE_FREE, 0, block, nullptr);
+    }
+    release_sized(block, size);
+}
+#endif
+
+void *operator new(std::size_t size){
+    return new_block(size);
+}
+
+void *operator new[](std::size_t size){
+    return new_block(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept{
+    return new_block_nothrow(size);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept{
+    return new_block_nothrow(size);
+}
+
+#ifdef __cpp_aligned_new
+void *operator new(std::size_t size, std::align_val_t alignment){
+    return new_aligned(size, (size_t)alignment);
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment){
+    return new_aligned(size, (size_t)alignment);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept{
+    return new_aligned_nothrow(size, (size_t)alignment);
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept{
+    return new_aligned_nothrow(size, (size_t)alignment);
+}
+#endif
+
+void operator delete(void *block) noexcept{
+    delete_block(block);
+}
+
+void operator delete[](void *block) noexcept{
+    delete_block(block);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void *block, std::size_t size) noexcept{
+    delete_sized(block, size);
+}
+
+void operator delete[](void *block, std::size_t size) noexcept{
+    delete_sized(block, size);
+}
+#endif
+
+void operator delete(void *block, const std::nothrow_t &) noexcept{
+    delete_block(block);
+}
+
+void operator delete[](void *block, const std::nothrow_t &) noexcept{
+    delete_block(block);
+}
+
+#ifdef __cpp_aligned_new
+// Over-aligned blocks never live in slab runs, so the alignment isn't needed
+void operator delete(void *block, std::align_val_t) noexcept{
+    delete_block(block);
+}
+
+void operator delete[](void *block, std::align_val_t) noexcept{
+    delete_block(block);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void *block, std::size_t size, std::align_val_t) noexcept{
+    delete_sized(block, size);
+}
+
+void operator delete[](void *block, std::size_t size, std::align_val_t) noexcept{
+    delete_sized(block, size);
+}
+#endif
+
+void operator delete(void *block, std::align_val_t, const std::nothrow_t &) noexcept{
+    delete_block(block);
+}
+
+void operator delete[](void *block, std::align_val_t, const std::nothrow_t &) noexcept{
+    delete_block(block);
+}
+#endif
@@ -0,0 +1,161 @@
+// Extensions of memalloc beyond the standard malloc family
+#ifndef MEMALLOC_H
+#define MEMALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// mallopt parameters of memalloc, alongside glibc's M_MMAP_THRESHOLD
+// M_MEMALLOC_TCACHE_DEPTH sets how many blocks a thread caches per size class.
+// The calling thread's bins shrink to it at once, other threads' bins when
+// they next fill up or the thread exits, so with depth 0 only at exit. It
+// fails, returning 0, while the per-CPU caches of MEMALLOC_PERCPU_CACHE are on.
+// M_MEMALLOC_PURGE_DECAY_MS sets how long free spans keep their pages.
+#define M_MEMALLOC_TCACHE_DEPTH   -100
+#define M_MEMALLOC_PURGE_DECAY_MS -101
+
+// Write the allocator's statistics into buf as a JSON object, NUL terminated
+// as long as len is not 0. Returns the length of the whole object like
+// snprintf does, so a result of len or more means buf was too small.
+// Counters are merged from all threads on every call, which doesn't stop them.
+size_t memalloc_stats_json(char *buf, size_t len);
+
+// Allocate n blocks of size bytes at once into out, each one to be freed like
+// a block from malloc. Returns how many were allocated, less than n only when
+// memory ran out. The blocks come from one size class under a single lock,
+// and those carved fresh are adjacent in memory, in the order of out.
+size_t memalloc_alloc_batch(size_t size, void **out, size_t n);
+
+// Free n blocks from malloc and friends at once. Null entries are skipped.
+// The blocks bypass the thread cache: those of the calling thread's arena are
+// freed under one lock, the others are handed to their arenas in one push each.
+void memalloc_free_batch(void **ptrs, size_t n);
+
+// C23 sized frees, for C libraries whose <stdlib.h> doesn't have them yet.
+// size must be what was asked of malloc, calloc (num * size), realloc or
+// aligned_alloc. Knowing it saves memalloc a lookup of the block's metadata.
+void free_sized(void *ptr, size_t size);
+void free_aligned_sized(void *ptr, size_t alignment, size_t size);
+
+// Regions
+// A region allocates by bumping a pointer through large chunks taken from the
+// heap. Its blocks are never freed on their own: memalloc_region_reset frees
+// all of them at once and keeps the region for reuse, memalloc_region_destroy
+// frees the region as well. This suits objects that all die together, like
+// those of one request. A region has no lock, so only one thread at a time
+// may use it. The blocks must not be passed to free or realloc.
+typedef struct memalloc_region memalloc_region;
+
+// Returns a new empty region, or a null pointer if memory ran out
+memalloc_region *memalloc_region_create(void);
+
+// Allocate size bytes from region, aligned like malloc. Returns a null
+// pointer when size is 0 or memory ran out.
+void *memalloc_region_alloc(memalloc_region *region, size_t size);
+
+// Like memalloc_region_alloc at a multiple of alignment, a power of two.
+// Other alignments fail with errno set to EINVAL.
+void *memalloc_region_memalign(memalloc_region *region, size_t alignment, size_t size);
+
+void memalloc_region_reset(memalloc_region *region);
+void memalloc_region_destroy(memalloc_region *region);
+
+// Write the live allocations sampled by the heap profiler to path in the
+// legacy pprof heap format. A null path picks <prefix>.<pid>.<n>.heap, see
+// MEMALLOC_PROF_PREFIX. Returns 0 on success, or -1 with errno set, EINVAL
+// if profiling is not enabled by MEMALLOC_PROF_SAMPLE.
+int memalloc_prof_dump(const char *path);
+
+// Trace files
+// MEMALLOC_TRACE=<prefix> records every malloc, free, calloc, realloc and
+// memalign call into <prefix>.<pid>. The file starts with a memalloc_trace_header and
+// then holds chunks: a memalloc_trace_chunk followed by count events of one
+// thread, in the order that thread made the calls. Events of different
+// threads can be put in order by their time. tools/replay.cpp replays them.
+#define MEMALLOC_TRACE_MAGIC "MATRACE1"
+
+enum memalloc_trace_op {
+    TRACE_MALLOC = 1,
+    TRACE_FREE,
+    TRACE_CALLOC,   // size is num * nsize
+    TRACE_REALLOC,  // ptr is the new block, old_ptr the one passed in
+    TRACE_MEMALIGN  // old_ptr holds the alignment
+};
+
+struct memalloc_trace_header {
+    char magic[8];
+    uint32_t event_size;  // sizeof(struct memalloc_trace_event)
+    uint32_t reserved;
+};
+
+struct memalloc_trace_chunk {
+    uint32_t thread;      // small number given to each thread in the order they first allocate
+    uint32_t count;
+};
+
+struct memalloc_trace_event {
+    uint64_t time;        // nanoseconds since tracing started
+    uint64_t op_size;     // op in the top 8 bits, the requested size below
+    uint64_t ptr;         // addresses identify blocks, they are never dereferenced
+    uint64_t old_ptr;
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+// A std::pmr::memory_resource owning a region, so containers can allocate from it:
+//   memalloc_region_resource resource;
+//   std::pmr::vector<std::pmr::string> names(&resource);
+// Deallocation does nothing, the memory comes back with reset() or when the
+// resource is destroyed. Like the region, it belongs to one thread at a time.
+#if defined(__cplusplus) && __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#include <new>
+
+class memalloc_region_resource : public std::pmr::memory_resource {
+public:
+    memalloc_region_resource() : region(memalloc_region_create()){
+        if (!region){
+            throw std::bad_alloc();
+        }
+    }
+    ~memalloc_region_resource() override {
+        memalloc_region_destroy(region);
+    }
+    memalloc_region_resource(const memalloc_region_resource &) = delete;
+    memalloc_region_resource &operator=(const memalloc_region_resource &) = delete;
+
+    // Frees everything allocated so far, every container using the resource must be gone
+    void reset(){
+        memalloc_region_reset(region);
+    }
+    memalloc_region *get() const {
+        return region;
+    }
+
+private:
+    memalloc_region *region;
+
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        void *block = memalloc_region_memalign(region, alignment, bytes ? bytes : 1);
+        if (!block){
+            throw std::bad_alloc();
+        }
+        return block;
+    }
+    void do_deallocate(void *, size_t, size_t) override {
+    }
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+};
+#endif
+#endif
+
+#endif
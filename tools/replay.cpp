@@ -0,0 +1,260 @@
+// Replay a trace recorded with MEMALLOC_TRACE against memalloc
+// Build it together with the allocator, so every allocation in the process,
+// the replayed ones included, goes through memalloc.cpp:
+//   g++ -O2 -o replay tools/replay.cpp memalloc.cpp -pthread
+//   MEMALLOC_MMAP_THRESHOLD=262144 ./replay trace.bin
+// Events of all threads are replayed from one thread in the order of their
+// timestamps, so runs are repeatable and settings can be compared directly.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <time.h>
+#include "../memalloc.h"
+
+// Map memory straight from the OS, so the replay's own bookkeeping doesn't
+// disturb the heap being measured
+static void *map_memory(size_t length){
+    void *memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED){
+        perror("mmap");
+        exit(1);
+    }
+    return memory;
+}
+
+// Open addressing table from traced addresses to the blocks replaying them.
+// Linear probing, deletions shift later entries back so no tombstones are needed.
+struct block_map {
+    struct entry {
+        uint64_t key; // 0 for an empty slot
+        void *block;
+        size_t size;  // as requested, to follow the live bytes
+    };
+    entry *slots;
+    size_t mask;
+
+    explicit block_map(size_t expected){
+        size_t size = 1024;
+        while (size < expected * 2){
+            size *= 2;
+        }
+        slots = static_cast<entry*>(map_memory(size * sizeof(entry)));
+        mask = size - 1;
+    }
+
+    static size_t hash(uint64_t key){
+        return (key >> 4) * 0x9E3779B97F4A7C15ULL >> 20;
+    }
+
+    void insert(uint64_t key, void *block, size_t size){
+        size_t i = hash(key) & mask;
+        while (slots[i].key && slots[i].key != key){
+            i = (i + 1) & mask;
+        }
+        slots[i].key = key;
+        slots[i].block = block;
+        slots[i].size = size;
+    }
+
+    // Remove key and return its entry, one with a null block if it isn't there
+    entry remove(uint64_t key){
+        size_t i = hash(key) & mask;
+        while (slots[i].key != key){
+            if (!slots[i].key){
+                return entry{ 0, nullptr, 0 };
+            }
+            i = (i + 1) & mask;
+        }
+        entry found = slots[i];
+        // Shift back entries whose probe sequence passes through the hole
+        size_t hole = i;
+        size_t j = i;
+        for (;;){
+            j = (j + 1) & mask;
+            if (!slots[j].key){
+                break;
+            }
+            size_t home = hash(slots[j].key) & mask;
+            // Move slots[j] if its home is not in (hole, j]
+            if (((j - home) & mask) >= ((j - hole) & mask)){
+                slots[hole] = slots[j];
+                hole = j;
+            }
+        }
+        slots[hole].key = 0;
+        return found;
+    }
+};
+
+static uint64_t now_ns(void){
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Resident set size in bytes, from /proc/self/statm
+static size_t current_rss(void){
+    size_t pages = 0;
+    size_t resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f){
+        if (fscanf(f, "%zu %zu", &pages, &resident) != 2){
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// Write one byte per page, so RSS behaves as if the program used its memory
+static void touch(void *block, size_t size){
+    char *p = static_cast<char*>(block);
+    for (size_t offset = 0; offset < size; offset += 4096){
+        p[offset] = 1;
+    }
+}
+
+int main(int argc, char **argv){
+    if (argc != 2){
+        fprintf(stderr, "usage: %s <trace>\n", argv[0]);
+        return 2;
+    }
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0){
+        perror(argv[1]);
+        return 1;
+    }
+    size_t length = (size_t)st.st_size;
+    if (length < sizeof(memalloc_trace_header)){
+        fprintf(stderr, "%s: too short for a trace\n", argv[1]);
+        return 1;
+    }
+    const char *data = static_cast<const char*>(mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0));
+    if (data == MAP_FAILED){
+        perror("mmap");
+        return 1;
+    }
+    const memalloc_trace_header *header = reinterpret_cast<const memalloc_trace_header*>(data);
+    if (memcmp(header->magic, MEMALLOC_TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->event_size != sizeof(memalloc_trace_event)){
+        fprintf(stderr, "%s: not a memalloc trace\n", argv[1]);
+        return 1;
+    }
+
+    // Count the events, a chunk cut short at the end is used as far as it goes
+    size_t total = 0;
+    unsigned threads = 0;
+    size_t offset = sizeof(memalloc_trace_header);
+    while (offset + sizeof(memalloc_trace_chunk) <= length){
+        const memalloc_trace_chunk *chunk = reinterpret_cast<const memalloc_trace_chunk*>(data + offset);
+        offset += sizeof(memalloc_trace_chunk);
+        size_t count = std::min<size_t>(chunk->count, (length - offset) / sizeof(memalloc_trace_event));
+        total += count;
+        threads = std::max(threads, chunk->thread + 1);
+        offset += count * sizeof(memalloc_trace_event);
+    }
+
+    // Put every event in order of time
+    const memalloc_trace_event **order = static_cast<const memalloc_trace_event**>(
+        map_memory((total ? total : 1) * sizeof(memalloc_trace_event*)));
+    size_t n = 0;
+    offset = sizeof(memalloc_trace_header);
+    while (offset + sizeof(memalloc_trace_chunk) <= length){
+        const memalloc_trace_chunk *chunk = reinterpret_cast<const memalloc_trace_chunk*>(data + offset);
+        offset += sizeof(memalloc_trace_chunk);
+        size_t count = std::min<size_t>(chunk->count, (length - offset) / sizeof(memalloc_trace_event));
+        const memalloc_trace_event *events = reinterpret_cast<const memalloc_trace_event*>(data + offset);
+        for (size_t i = 0; i < count; i++){
+            order[n++] = &events[i];
+        }
+        offset += count * sizeof(memalloc_trace_event);
+    }
+    // Within a thread times never go backwards, so a stable sort keeps each thread's own order
+    std::stable_sort(order, order + n, [](const memalloc_trace_event *a, const memalloc_trace_event *b){
+        return a->time < b->time;
+    });
+
+    block_map live(total);
+    size_t live_bytes = 0;
+    size_t peak_live_bytes = 0;
+    size_t unknown_frees = 0;
+    // The trace and the index are resident by now, so whatever the peak RSS
+    // reaches above this is the heap
+    size_t base_rss = current_rss();
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < n; i++){
+        const memalloc_trace_event *event = order[i];
+        unsigned op = (unsigned)(event->op_size >> 56);
+        size_t size = (size_t)(event->op_size & (((uint64_t)1 << 56) - 1));
+        void *block = nullptr;
+        switch (op){
+        case TRACE_MALLOC:
+            block = malloc(size);
+            break;
+        case TRACE_CALLOC:
+            block = calloc(1, size);
+            break;
+        case TRACE_MEMALIGN:
+            block = memalign((size_t)event->old_ptr, size);
+            break;
+        case TRACE_REALLOC: {
+            block_map::entry old = event->old_ptr ? live.remove(event->old_ptr) : block_map::entry{ 0, nullptr, 0 };
+            live_bytes -= old.size;
+            block = realloc(old.block, size);
+            // A failed realloc leaves the old block where it was
+            if (!block && old.block && size){
+                live.insert(event->old_ptr, old.block, old.size);
+                live_bytes += old.size;
+            }
+            break;
+        }
+        case TRACE_FREE: {
+            block_map::entry old = live.remove(event->ptr);
+            if (old.block){
+                live_bytes -= old.size;
+                free(old.block);
+            } else {
+                // Allocated before tracing started, or by a call that isn't traced
+                unknown_frees++;
+            }
+            continue;
+        }
+        default:
+            fprintf(stderr, "unknown event %u at %zu\n", op, i);
+            return 1;
+        }
+        if (block && event->ptr){
+            touch(block, size);
+            live.insert(event->ptr, block, size);
+            live_bytes += size;
+            peak_live_bytes = std::max(peak_live_bytes, live_bytes);
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    size_t peak_rss = (size_t)usage.ru_maxrss * 1024;
+    size_t heap_rss = peak_rss > base_rss ? peak_rss - base_rss : 0;
+
+    printf("events          %zu from %u threads\n", n, threads);
+    printf("time            %.3f s, %.0f events/s\n", elapsed / 1e9, elapsed ? n / (elapsed / 1e9) : 0.0);
+    printf("peak live       %zu KB\n", peak_live_bytes / 1024);
+    printf("peak heap rss   %zu KB (%.2fx peak live)\n", heap_rss / 1024,
+           peak_live_bytes ? (double)heap_rss / peak_live_bytes : 0.0);
+    printf("live at end     %zu KB\n", live_bytes / 1024);
+    printf("unknown frees   %zu\n", unknown_frees);
+    static char stats[1 << 16];
+    memalloc_stats_json(stats, sizeof(stats));
+    printf("stats           %s\n", stats);
+    return 0;
+}